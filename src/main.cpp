@@ -1,17 +1,57 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <openssl/sha.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+// <linux/io_uring.h> pulls in <linux/fs.h>, whose BLOCK_SIZE macro would
+// shadow ours.
+#undef BLOCK_SIZE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <expected>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
 #include <stdexcept>
 #include <map>
@@ -25,15 +65,19 @@ namespace BitTorrent {
     static const int BLOCK_SIZE = 16 * 1024;
     static const int PIECE_HASH_LEN = 20;
     static const int HANDSHAKE_LEN = 68;
+    static const uint32_t MAX_MESSAGE_LEN = 2 * 1024 * 1024;
 
     struct TorrentInfo {
         std::string announce;
         long long length;
         long long piece_length;
-        std::string pieces;
+        std::string_view pieces;
         std::string name;
         std::string info_hash_str;
         std::vector<uint8_t> info_hash_raw;
+        // Keeps alive the buffer `pieces` points into (a file mapping or the
+        // metadata received from a peer).
+        std::shared_ptr<const void> storage;
     };
 
     struct PeerAddress {
@@ -41,6 +85,47 @@ namespace BitTorrent {
         uint16_t port;
     };
 
+    // Malformed, MissingField and WrongType come from decoding; the rest from
+    // talking to peers.
+    enum class Errc { Malformed, MissingField, WrongType, ConnectionClosed, Io, Protocol, HashMismatch, Rejected };
+
+    // `detail` names the offending field, or describes what went wrong. It
+    // always refers to static storage. `sys` is the errno of an Io error.
+    struct Error {
+        Errc code;
+        std::string_view detail;
+        int sys = 0;
+
+        std::string Message() const {
+            switch (code) {
+                case Errc::MissingField: return "Missing field '" + std::string(detail) + "'";
+                case Errc::WrongType:
+                    if (detail.empty()) return "Bencoded value has the wrong type";
+                    return "Field '" + std::string(detail) + "' has the wrong type";
+                case Errc::ConnectionClosed: return "Connection closed";
+                case Errc::Io: return std::string(detail) + " failed: " + std::strerror(sys);
+                case Errc::Protocol: return "Protocol error: " + std::string(detail);
+                case Errc::HashMismatch: return "Piece hash mismatch";
+                case Errc::Rejected: return "Peer rejected " + std::string(detail);
+                case Errc::Malformed: break;
+            }
+            return "Malformed bencode: " + std::string(detail);
+        }
+    };
+
+    template <typename T>
+    using Result = std::expected<T, Error>;
+
+    template <typename T>
+    T OrThrow(Result<T> r) {
+        if (!r) throw std::runtime_error(r.error().Message());
+        return std::move(*r);
+    }
+
+    inline void OrThrow(Result<void> r) {
+        if (!r) throw std::runtime_error(r.error().Message());
+    }
+
     class Utils {
     public:
         static std::string ToHex(const unsigned char* hash, size_t len) {
@@ -61,6 +146,29 @@ namespace BitTorrent {
             return o.str();
         }
 
+        // Big-endian fields, as every wire format here uses.
+        static void Put16(uint8_t* p, uint16_t v) {
+            v = htons(v);
+            std::memcpy(p, &v, 2);
+        }
+
+        static void Put32(uint8_t* p, uint32_t v) {
+            v = htonl(v);
+            std::memcpy(p, &v, 4);
+        }
+
+        static uint16_t Get16(const uint8_t* p) {
+            uint16_t v;
+            std::memcpy(&v, p, 2);
+            return ntohs(v);
+        }
+
+        static uint32_t Get32(const uint8_t* p) {
+            uint32_t v;
+            std::memcpy(&v, p, 4);
+            return ntohl(v);
+        }
+
         static std::string GeneratePeerId() {
             std::string s = "-CC0001-";
             std::random_device r;
@@ -69,7 +177,7 @@ namespace BitTorrent {
             return s;
         }
 
-        static std::vector<uint8_t> CalculateSHA1(const std::string& input) {
+        static std::vector<uint8_t> CalculateSHA1(std::string_view input) {
             std::vector<uint8_t> hash(20);
             SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), hash.data());
             return hash;
@@ -107,535 +215,5791 @@ namespace BitTorrent {
         }
     };
 
+    // Read-only private mapping of a whole file.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) throw std::runtime_error("Cannot open file");
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                close(fd);
+                throw std::runtime_error("Cannot stat file");
+            }
+            size_ = static_cast<size_t>(st.st_size);
+            if (size_ > 0) {
+                void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr == MAP_FAILED) {
+                    close(fd);
+                    throw std::runtime_error("Cannot map file");
+                }
+                data_ = static_cast<const char*>(addr);
+            }
+            close(fd);
+        }
+
+        ~MappedFile() {
+            if (data_) munmap(const_cast<char*>(data_), size_);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        std::string_view View() const { return std::string_view(data_ ? data_ : "", size_); }
+
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    enum class BType : uint32_t { Integer, String, List, Dict };
+
+    // One entry of the flat bencode tape. A container is followed by its
+    // children in document order (dict keys and values alternate), and `span`
+    // counts the nodes of the whole subtree so siblings are one add away.
+    // Strings keep their contents in `str`; containers keep their complete
+    // encoding there, from the opening 'l'/'d' through the closing 'e'.
+    struct BNode {
+        BType type;
+        uint32_t span;
+        union {
+            long long integer;
+            struct {
+                uint32_t offset;
+                uint32_t length;
+            } str;
+        };
+    };
+
+    // Non-owning handle to a value on a BDocument tape. Strings point into the
+    // buffer that was decoded, so that buffer must outlive the value.
+    struct BEntry;
+
+    class BValue {
+    public:
+        class Iterator {
+        public:
+            Iterator(const BNode* node, const char* src, bool dict) : node_(node), src_(src), dict_(dict) {}
+
+            BEntry operator*() const;
+
+            Iterator& operator++() {
+                if (dict_) node_ += 1 + node_[1].span;
+                else node_ += node_->span;
+                return *this;
+            }
+
+            bool operator!=(const Iterator& other) const { return node_ != other.node_; }
+
+        private:
+            const BNode* node_;
+            const char* src_;
+            bool dict_;
+        };
+
+        BValue() = default;
+        BValue(const BNode* node, const char* src) : node_(node), src_(src) {}
+
+        explicit operator bool() const { return node_ != nullptr; }
+
+        BType Type() const { return node_->type; }
+        bool IsInt() const { return node_->type == BType::Integer; }
+        bool IsString() const { return node_->type == BType::String; }
+        bool IsList() const { return node_->type == BType::List; }
+        bool IsDict() const { return node_->type == BType::Dict; }
+
+        // Iterates list elements or dict entries; `key` is empty for lists.
+        Iterator begin() const { return Iterator(node_ + 1, src_, IsDict()); }
+        Iterator end() const { return Iterator(node_ + node_->span, src_, IsDict()); }
+
+        BValue Find(std::string_view key) const {
+            if (!IsDict()) return BValue();
+            const BNode* last = node_ + node_->span;
+            for (const BNode* k = node_ + 1; k != last; k += 1 + k[1].span) {
+                if (BValue(k, src_).str() == key) return BValue(k + 1, src_);
+            }
+            return BValue();
+        }
+
+        bool Contains(std::string_view key) const { return static_cast<bool>(Find(key)); }
+
+        BValue At(std::string_view key) const {
+            BValue v = Find(key);
+            if (!v) throw std::runtime_error("Missing key: " + std::string(key));
+            return v;
+        }
+
+        long long AsInt() const {
+            if (!IsInt()) throw std::runtime_error("Bencoded value is not an integer");
+            return node_->integer;
+        }
+
+        std::string_view AsString() const {
+            if (!IsString()) throw std::runtime_error("Bencoded value is not a string");
+            return str();
+        }
+
+        // The exact input bytes of a list or dict, e.g. for hashing an info
+        // dict without re-encoding it.
+        std::string_view Raw() const {
+            if (!IsList() && !IsDict()) throw std::runtime_error("Bencoded value is not a container");
+            return str();
+        }
+
+    private:
+        std::string_view str() const { return std::string_view(src_ + node_->str.offset, node_->str.length); }
+
+        const BNode* node_ = nullptr;
+        const char* src_ = nullptr;
+    };
+
+    struct BEntry {
+        std::string_view key;
+        BValue value;
+    };
+
+    inline BEntry BValue::Iterator::operator*() const {
+        if (!dict_) return {std::string_view(), BValue(node_, src_)};
+        return {BValue(node_, src_).str(), BValue(node_ + 1, src_)};
+    }
+
+    // Decoded bencode document: the whole DOM lives in one tape allocation.
+    class BDocument {
+    public:
+        BValue Root() const { return BValue(tape_.data(), src_.data()); }
+        size_t NodeCount() const { return tape_.size(); }
+
+    private:
+        friend class BEncoder;
+
+        std::string_view src_;
+        std::vector<BNode> tape_;
+    };
+
+    // Positions of every ':' and 'e' byte in a bencoded buffer, found 64 bytes
+    // at a time. Digit runs in valid input end exactly at one of these bytes
+    // (length prefixes at ':', integers at 'e'), so the parser can take token
+    // boundaries from the index instead of searching byte by byte.
+    class BStructuralIndex {
+    public:
+        static constexpr size_t WINDOW = 4096;
+
+        // Indexes [begin, end) into `out`, which must hold end - begin entries.
+        // Returns the number of positions written.
+        static size_t Scan(std::string_view s, size_t begin, size_t end, uint32_t* out) {
+            uint32_t* cursor = out;
+            size_t i = begin;
+#if defined(__x86_64__) || defined(__i386__)
+            if (HasAvx2()) i = ScanAvx2(s.data(), i, end, cursor);
+            else i = ScanSse2(s.data(), i, end, cursor);
+#endif
+            for (; i < end; i++) {
+                if (s[i] == ':' || s[i] == 'e') *cursor++ = static_cast<uint32_t>(i);
+            }
+            return cursor - out;
+        }
+
+        static std::vector<uint32_t> Build(std::string_view s) {
+            std::vector<uint32_t> out;
+            uint32_t window[WINDOW];
+            for (size_t begin = 0; begin < s.size(); begin += WINDOW) {
+                size_t n = Scan(s, begin, std::min(s.size(), begin + WINDOW), window);
+                out.insert(out.end(), window, window + n);
+            }
+            return out;
+        }
+
+    private:
+        static void Emit(uint64_t mask, size_t base, uint32_t*& out) {
+            while (mask) {
+                *out++ = static_cast<uint32_t>(base + __builtin_ctzll(mask));
+                mask &= mask - 1;
+            }
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        static bool HasAvx2() {
+            static const bool supported = __builtin_cpu_supports("avx2");
+            return supported;
+        }
+
+        static size_t ScanSse2(const char* data, size_t i, size_t end, uint32_t*& out) {
+            const __m128i colon = _mm_set1_epi8(':');
+            const __m128i term = _mm_set1_epi8('e');
+            for (; i + 64 <= end; i += 64) {
+                uint64_t mask = 0;
+                for (int k = 0; k < 4; k++) {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + k * 16));
+                    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, term));
+                    mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(hit))) << (k * 16);
+                }
+                Emit(mask, i, out);
+            }
+            return i;
+        }
+
+        __attribute__((target("avx2")))
+        static size_t ScanAvx2(const char* data, size_t i, size_t end, uint32_t*& out) {
+            const __m256i colon = _mm256_set1_epi8(':');
+            const __m256i term = _mm256_set1_epi8('e');
+            for (; i + 64 <= end; i += 64) {
+                __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+                uint32_t lo_mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(lo, colon), _mm256_cmpeq_epi8(lo, term)));
+                uint32_t hi_mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(hi, colon), _mm256_cmpeq_epi8(hi, term)));
+                Emit(static_cast<uint64_t>(hi_mask) << 32 | lo_mask, i, out);
+            }
+            return i;
+        }
+#endif
+    };
+
     class BEncoder {
     public:
         static std::string Encode(const json& j) {
-            if (j.is_number_integer()) return "i" + std::to_string(j.get<long long>()) + "e";
-            if (j.is_string()) {
-                std::string s = j.get<std::string>();
-                return std::to_string(s.size()) + ":" + s;
+            std::string out;
+            out.reserve(EncodedSize(j));
+            EncodeTo(j, out);
+            return out;
+        }
+
+        // Appends the encoding of `j` to `out` (a std::string or byte vector)
+        // in one linear pass. json objects keep their keys sorted, which is
+        // the order bencode requires. Reserve EncodedSize(j) first to make the
+        // whole encode a single allocation.
+        template <typename Buffer>
+        static void EncodeTo(const json& j, Buffer& out) {
+            if (j.is_number_integer()) {
+                out.push_back('i');
+                AppendInt(out, j.get<long long>());
+                out.push_back('e');
+            } else if (j.is_string()) {
+                const std::string& str = j.get_ref<const std::string&>();
+                AppendString(out, str);
+            } else if (j.is_array()) {
+                out.push_back('l');
+                for (const auto& elem : j) EncodeTo(elem, out);
+                out.push_back('e');
+            } else if (j.is_object()) {
+                out.push_back('d');
+                for (const auto& el : j.items()) {
+                    AppendString(out, el.key());
+                    EncodeTo(el.value(), out);
+                }
+                out.push_back('e');
+            } else {
+                throw std::runtime_error("Unsupported type for BEncoding");
             }
+        }
+
+        static size_t EncodedSize(const json& j) {
+            if (j.is_number_integer()) return 2 + IntLength(j.get<long long>());
+            if (j.is_string()) return StringLength(j.get_ref<const std::string&>().size());
             if (j.is_array()) {
-                std::string out = "l";
-                for (const auto& elem : j) out += Encode(elem);
-                return out + "e";
+                size_t size = 2;
+                for (const auto& elem : j) size += EncodedSize(elem);
+                return size;
             }
             if (j.is_object()) {
-                std::string out = "d";
-                std::vector<std::string> keys;
-                for (auto& el : j.items()) keys.push_back(el.key());
-                std::sort(keys.begin(), keys.end());
-                for (const auto& key : keys) {
-                    out += Encode(key) + Encode(j.at(key));
-                }
-                return out + "e";
+                size_t size = 2;
+                for (const auto& el : j.items()) size += StringLength(el.key().size()) + EncodedSize(el.value());
+                return size;
             }
             throw std::runtime_error("Unsupported type for BEncoding");
         }
 
         static json Decode(const std::string& s) {
             int pos = 0;
-            return ParseValue(s, pos);
+            return OrThrow(TryDecode(s, pos));
         }
 
         static json Decode(const std::string& s, int& out_pos) {
             out_pos = 0;
-            return ParseValue(s, out_pos);
+            return OrThrow(TryDecode(s, out_pos));
+        }
+
+        static Result<json> TryDecode(const std::string& s, int& pos) {
+            return ParseValue(s, pos);
+        }
+
+        // Decodes without copying: strings in the result are views into `s`.
+        static BDocument DecodeView(std::string_view s) {
+            size_t pos = 0;
+            return OrThrow(TryDecodeView(s, pos));
+        }
+
+        static BDocument DecodeView(std::string_view s, size_t& out_pos) {
+            out_pos = 0;
+            return OrThrow(TryDecodeView(s, out_pos));
+        }
+
+        // Same as DecodeView, optionally taking token boundaries from the
+        // SIMD structural index. `bench decode` compares the two.
+        static BDocument DecodeView(std::string_view s, bool use_index) {
+            size_t pos = 0;
+            return OrThrow(DecodeTape(s, pos, use_index));
+        }
+
+        static Result<BDocument> TryDecodeView(std::string_view s, size_t& pos) {
+            return DecodeTape(s, pos, false);
+        }
+
+        // BEP 3 integers: an optional minus sign and digits, without leading
+        // zeros or "-0".
+        static Result<long long> ParseInteger(std::string_view s, size_t begin, size_t end) {
+            size_t first = begin < end && s[begin] == '-' ? begin + 1 : begin;
+            if (first < end && s[first] == '0' && (end - first > 1 || first != begin)) return std::unexpected(Error{Errc::Malformed, "invalid integer"});
+            long long val = 0;
+            auto [ptr, ec] = std::from_chars(s.data() + begin, s.data() + end, val);
+            if (ec != std::errc() || ptr != s.data() + end) return std::unexpected(Error{Errc::Malformed, "invalid integer"});
+            return val;
         }
 
     private:
-        static json ParseValue(const std::string& s, int& i) {
-            if (isdigit(s[i])) return ParseString(s, i);
-            if (s[i] == 'i') return ParseInt(s, i);
+        template <typename Buffer>
+        static void AppendInt(Buffer& out, long long v) {
+            char digits[24];
+            auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), v);
+            out.insert(out.end(), digits, end);
+        }
+
+        template <typename Buffer>
+        static void AppendString(Buffer& out, std::string_view str) {
+            AppendInt(out, static_cast<long long>(str.size()));
+            out.push_back(':');
+            out.insert(out.end(), str.begin(), str.end());
+        }
+
+        static size_t IntLength(long long v) {
+            char digits[24];
+            return std::to_chars(digits, digits + sizeof(digits), v).ptr - digits;
+        }
+
+        static size_t StringLength(size_t len) { return IntLength(static_cast<long long>(len)) + 1 + len; }
+
+        static Result<json> ParseValue(const std::string& s, int& i) {
+            if (static_cast<size_t>(i) >= s.size()) return std::unexpected(Error{Errc::Malformed, "unexpected end of data"});
+            if (isdigit(static_cast<unsigned char>(s[i]))) {
+                Result<std::string> str = ParseString(s, i);
+                if (!str) return std::unexpected(str.error());
+                return json(std::move(*str));
+            }
+            if (s[i] == 'i') {
+                Result<long long> val = ParseInt(s, i);
+                if (!val) return std::unexpected(val.error());
+                return json(*val);
+            }
             if (s[i] == 'l') return ParseList(s, i);
             if (s[i] == 'd') return ParseDict(s, i);
-            throw std::runtime_error("Invalid bencoded string");
+            return std::unexpected(Error{Errc::Malformed, "invalid value"});
         }
 
-        static long long ParseInt(const std::string& s, int& i) {
+        static Result<long long> ParseInt(const std::string& s, int& i) {
             i++; 
             size_t end = s.find('e', i);
-            if (end == std::string::npos) throw std::runtime_error("Unterminated integer");
-            long long val = std::stoll(s.substr(i, end - i));
+            if (end == std::string::npos) return std::unexpected(Error{Errc::Malformed, "unterminated integer"});
+            Result<long long> val = ParseInteger(s, i, end);
             i = end + 1;
             return val;
         }
 
-        static std::string ParseString(const std::string& s, int& i) {
+        static Result<std::string> ParseString(const std::string& s, int& i) {
             size_t colon = s.find(':', i);
-            if (colon == std::string::npos) throw std::runtime_error("Invalid string length");
-            long long len = std::stoll(s.substr(i, colon - i));
+            if (colon == std::string::npos) return std::unexpected(Error{Errc::Malformed, "invalid string length"});
+            Result<long long> len = ParseInteger(s, i, colon);
+            if (!len) return std::unexpected(len.error());
+            if (*len < 0 || static_cast<size_t>(*len) > s.size() - colon - 1) return std::unexpected(Error{Errc::Malformed, "string length out of range"});
             i = colon + 1;
-            std::string val = s.substr(i, len);
-            i += len;
+            std::string val = s.substr(i, *len);
+            i += *len;
             return val;
         }
 
-        static json ParseList(const std::string& s, int& i) {
+        static Result<json> ParseList(const std::string& s, int& i) {
             i++; 
             json list = json::array();
-            while (s[i] != 'e') list.push_back(ParseValue(s, i));
+            while (static_cast<size_t>(i) < s.size() && s[i] != 'e') {
+                Result<json> elem = ParseValue(s, i);
+                if (!elem) return elem;
+                list.push_back(std::move(*elem));
+            }
+            if (static_cast<size_t>(i) >= s.size()) return std::unexpected(Error{Errc::Malformed, "unterminated list"});
             i++;
             return list;
         }
 
-        static json ParseDict(const std::string& s, int& i) {
+        static Result<json> ParseDict(const std::string& s, int& i) {
             i++; 
             json dict = json::object();
-            while (s[i] != 'e') {
-                std::string key = ParseString(s, i);
-                dict[key] = ParseValue(s, i);
+            while (static_cast<size_t>(i) < s.size() && s[i] != 'e') {
+                if (!isdigit(static_cast<unsigned char>(s[i]))) return std::unexpected(Error{Errc::Malformed, "dictionary key is not a string"});
+                Result<std::string> key = ParseString(s, i);
+                if (!key) return std::unexpected(key.error());
+                Result<json> value = ParseValue(s, i);
+                if (!value) return value;
+                dict[*key] = std::move(*value);
             }
+            if (static_cast<size_t>(i) >= s.size()) return std::unexpected(Error{Errc::Malformed, "unterminated dictionary"});
             i++;
             return dict;
         }
+
+        static Result<BDocument> DecodeTape(std::string_view s, size_t& i, bool use_index) {
+            if (s.size() > UINT32_MAX) return std::unexpected(Error{Errc::Malformed, "input too large"});
+            BDocument doc;
+            doc.src_ = s;
+            // Metadata and tracker bodies average well over 16 bytes per node
+            // (the pieces blob is one node), so this usually holds the whole
+            // tape. Denser input grows it geometrically; the tape is only
+            // indexed, never pointed into, while it is built.
+            doc.tape_.reserve(s.size() / 16 + 16);
+            Result<void> r;
+            if (use_index) {
+                IndexFinder finder;
+                r = ParseTapeValue(s, i, doc.tape_, finder, 0);
+            } else {
+                ScanFinder finder;
+                r = ParseTapeValue(s, i, doc.tape_, finder, 0);
+            }
+            if (!r) return std::unexpected(r.error());
+            return doc;
+        }
+
+        static constexpr int MAX_DEPTH = 512;
+
+        // Token boundary lookup: both return the position of the byte that ends
+        // the digit run starting at `i`, and the caller checks it is the byte
+        // it expected.
+        struct ScanFinder {
+            size_t Next(std::string_view s, size_t i, char) {
+                if (i < s.size() && s[i] == '-') i++;
+                while (i < s.size() && static_cast<unsigned>(s[i] - '0') < 10) i++;
+                return i < s.size() ? i : std::string_view::npos;
+            }
+        };
+
+        // Walks the structural index one window at a time. A window is only
+        // indexed once the parser reaches it, so long strings such as the
+        // pieces blob are skipped rather than scanned.
+        struct IndexFinder {
+            uint32_t positions[BStructuralIndex::WINDOW];
+            size_t count = 0;
+            size_t next = 0;
+            size_t indexed_end = 0;
+
+            size_t Next(std::string_view s, size_t i, char) {
+                while (true) {
+                    while (next < count && positions[next] < i) next++;
+                    if (next < count) return positions[next];
+                    if (i >= s.size()) return std::string_view::npos;
+                    size_t begin = std::max(i, indexed_end);
+                    indexed_end = std::min(s.size(), begin + BStructuralIndex::WINDOW);
+                    count = BStructuralIndex::Scan(s, begin, indexed_end, positions);
+                    next = 0;
+                }
+            }
+        };
+
+        template <typename Finder>
+        static Result<void> ParseTapeValue(std::string_view s, size_t& i, std::vector<BNode>& tape, Finder& finder, int depth) {
+            if (i >= s.size()) return std::unexpected(Error{Errc::Malformed, "unexpected end of data"});
+            if (depth > MAX_DEPTH) return std::unexpected(Error{Errc::Malformed, "nested too deeply"});
+            size_t self = tape.size();
+            BNode& node = tape.emplace_back();
+            node.span = 1;
+            char c = s[i];
+            if (isdigit(static_cast<unsigned char>(c))) {
+                Result<std::string_view> str = ParseViewString(s, i, finder);
+                if (!str) return std::unexpected(str.error());
+                node.type = BType::String;
+                node.str.offset = static_cast<uint32_t>(str->data() - s.data());
+                node.str.length = static_cast<uint32_t>(str->size());
+            } else if (c == 'i') {
+                size_t end = finder.Next(s, i + 1, 'e');
+                if (end == std::string_view::npos || s[end] != 'e') return std::unexpected(Error{Errc::Malformed, "unterminated integer"});
+                Result<long long> val = ParseInteger(s, i + 1, end);
+                if (!val) return std::unexpected(val.error());
+                node.type = BType::Integer;
+                node.integer = *val;
+                i = end + 1;
+            } else if (c == 'l' || c == 'd') {
+                bool dict = c == 'd';
+                size_t start = i;
+                node.type = dict ? BType::Dict : BType::List;
+                i++;
+                while (i < s.size() && s[i] != 'e') {
+                    if (dict) {
+                        if (!isdigit(static_cast<unsigned char>(s[i]))) return std::unexpected(Error{Errc::Malformed, "dictionary key is not a string"});
+                        Result<void> key = ParseTapeValue(s, i, tape, finder, depth + 1);
+                        if (!key) return key;
+                    }
+                    Result<void> value = ParseTapeValue(s, i, tape, finder, depth + 1);
+                    if (!value) return value;
+                }
+                if (i >= s.size()) return std::unexpected(Error{Errc::Malformed, dict ? "unterminated dictionary" : "unterminated list"});
+                i++;
+                tape[self].span = static_cast<uint32_t>(tape.size() - self);
+                tape[self].str.offset = static_cast<uint32_t>(start);
+                tape[self].str.length = static_cast<uint32_t>(i - start);
+            } else {
+                return std::unexpected(Error{Errc::Malformed, "invalid value"});
+            }
+            return {};
+        }
+
+        template <typename Finder>
+        static Result<std::string_view> ParseViewString(std::string_view s, size_t& i, Finder& finder) {
+            size_t colon = finder.Next(s, i, ':');
+            if (colon == std::string_view::npos || s[colon] != ':') return std::unexpected(Error{Errc::Malformed, "invalid string length"});
+            Result<long long> len = ParseInteger(s, i, colon);
+            if (!len) return std::unexpected(len.error());
+            if (*len < 0 || static_cast<size_t>(*len) > s.size() - colon - 1) return std::unexpected(Error{Errc::Malformed, "string length out of range"});
+            i = colon + 1 + *len;
+            return s.substr(colon + 1, *len);
+        }
     };
 
-    class Network {
+    // Resumable bencode parser for data that arrives in pieces. Feed() scans
+    // each byte once and keeps only one copy of the input; string bodies are
+    // skipped by count. Integers and string lengths follow the same grammar
+    // as BEncoder. Once a complete value is buffered it is in Value(), and
+    // anything fed past its end is left in Trailing().
+    class BStreamParser {
     public:
-       static int Connect(const std::string& ip, uint16_t port) {
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (sock < 0) throw std::runtime_error("Socket creation failed");
+        // Returns true once a complete value has been buffered. A malformed
+        // byte leaves the parser stuck on that error until Next().
+        Result<bool> Feed(std::string_view chunk) {
+            buffer_.append(chunk);
+            Result<void> r = Scan();
+            if (!r) return std::unexpected(r.error());
+            return state_ == State::Done;
+        }
 
-        
-            struct timeval tv;
-            tv.tv_sec = 10;
-            tv.tv_usec = 0;
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+        bool Complete() const { return state_ == State::Done; }
 
-            sockaddr_in addr{};
-            addr.sin_family = AF_INET;
-            addr.sin_port = htons(port);
-            addr.sin_addr.s_addr = inet_addr(ip.c_str());
+        std::string_view Value() const { return std::string_view(buffer_).substr(0, value_end_); }
+        std::string_view Trailing() const { return std::string_view(buffer_).substr(value_end_); }
 
-            if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
-                close(sock);
-                return -1;
+        // Drops the completed value and starts on whatever followed it.
+        Result<bool> Next() {
+            buffer_.erase(0, value_end_);
+            state_ = State::Value;
+            stack_.clear();
+            scanned_ = value_end_ = 0;
+            Result<void> r = Scan();
+            if (!r) return std::unexpected(r.error());
+            return Complete();
+        }
+
+    private:
+        enum class State { Value, Length, Integer, StringBody, Done };
+        enum Frame : uint8_t { LIST, DICT_KEY, DICT_VALUE };
+
+        static constexpr size_t MAX_DEPTH = 512;
+
+        Result<void> Scan() {
+            while (scanned_ < buffer_.size() && state_ != State::Done) {
+                char c = buffer_[scanned_];
+                bool digit = static_cast<unsigned>(c - '0') < 10;
+                switch (state_) {
+                    case State::Value:
+                        if (c == 'e') {
+                            if (stack_.empty() || stack_.back() == DICT_VALUE) return Fail("unexpected end of container");
+                            stack_.pop_back();
+                            scanned_++;
+                            EndValue();
+                        } else if (!stack_.empty() && stack_.back() == DICT_KEY && !digit) {
+                            return Fail("dictionary key is not a string");
+                        } else if (digit) {
+                            state_ = State::Length;
+                            length_ = digits_ = 0;
+                        } else if (c == 'i') {
+                            state_ = State::Integer;
+                            digits_ = magnitude_ = 0;
+                            negative_ = false;
+                            scanned_++;
+                        } else if (c == 'l' || c == 'd') {
+                            if (stack_.size() >= MAX_DEPTH) return Fail("nested too deeply");
+                            stack_.push_back(c == 'l' ? LIST : DICT_KEY);
+                            scanned_++;
+                        } else {
+                            return Fail("invalid value");
+                        }
+                        break;
+                    case State::Length:
+                        scanned_++;
+                        if (digit) {
+                            // A digit after a leading zero.
+                            if (digits_ > 0 && length_ == 0) return Fail("invalid string length");
+                            if (length_ > UINT32_MAX / 10) return Fail("string length out of range");
+                            length_ = length_ * 10 + (c - '0');
+                            digits_++;
+                        } else if (c == ':') {
+                            string_remaining_ = length_;
+                            state_ = State::StringBody;
+                            if (string_remaining_ == 0) EndValue();
+                        } else {
+                            return Fail("invalid string length");
+                        }
+                        break;
+                    case State::StringBody: {
+                        size_t take = std::min(string_remaining_, buffer_.size() - scanned_);
+                        scanned_ += take;
+                        string_remaining_ -= take;
+                        if (string_remaining_ == 0) EndValue();
+                        break;
+                    }
+                    case State::Integer:
+                        scanned_++;
+                        if (c == 'e') {
+                            if (digits_ == 0 || (negative_ && magnitude_ == 0)) return Fail("invalid integer");
+                            EndValue();
+                        } else if (c == '-' && digits_ == 0 && !negative_) {
+                            negative_ = true;
+                        } else if (digit && (digits_ == 0 || magnitude_ != 0)) {
+                            uint64_t limit = static_cast<uint64_t>(INT64_MAX) + negative_;
+                            if (magnitude_ > (limit - (c - '0')) / 10) return Fail("integer out of range");
+                            magnitude_ = magnitude_ * 10 + (c - '0');
+                            digits_++;
+                        } else {
+                            return Fail("invalid integer");
+                        }
+                        break;
+                    case State::Done:
+                        break;
+                }
             }
-            return sock;
+            return {};
         }
 
+        static std::unexpected<Error> Fail(std::string_view detail) { return std::unexpected(Error{Errc::Malformed, detail}); }
 
-        static int ConnectHostname(const std::string& hostname, const std::string& port) {
-            addrinfo hints{}, *res;
-            hints.ai_family = AF_INET;
-            hints.ai_socktype = SOCK_STREAM;
-            
-            if (getaddrinfo(hostname.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+        void EndValue() {
+            if (stack_.empty()) {
+                state_ = State::Done;
+                value_end_ = scanned_;
+                return;
+            }
+            state_ = State::Value;
+            if (stack_.back() == DICT_KEY) stack_.back() = DICT_VALUE;
+            else if (stack_.back() == DICT_VALUE) stack_.back() = DICT_KEY;
+        }
 
-            int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-            if (sock < 0) {
-                freeaddrinfo(res);
-                return -1;
+        std::string buffer_;
+        size_t scanned_ = 0;
+        size_t value_end_ = 0;
+        State state_ = State::Value;
+        std::vector<Frame> stack_;
+        size_t length_ = 0;
+        size_t string_remaining_ = 0;
+        size_t digits_ = 0;
+        uint64_t magnitude_ = 0;
+        bool negative_ = false;
+    };
+
+    // Renders bencode as JSON while it is being read, holding only the open
+    // containers and at most one short string. Strings that are valid UTF-8
+    // and no longer than INLINE_LIMIT are written as JSON strings escaped the
+    // way nlohmann::json::dump() does; anything else is written as "hex:"
+    // followed by its bytes in hex, streamed as they arrive.
+    class BJsonWriter {
+    public:
+        static constexpr size_t INLINE_LIMIT = 64 * 1024;
+
+        explicit BJsonWriter(std::ostream& out) : out_(out) {}
+
+        // Returns true once a complete value has been written. Bytes past the
+        // end of the value are ignored.
+        Result<bool> Feed(std::string_view chunk) {
+            size_t i = 0;
+            while (i < chunk.size() && state_ != State::Done) {
+                char c = chunk[i];
+                bool digit = static_cast<unsigned>(c - '0') < 10;
+                switch (state_) {
+                    case State::Value:
+                        i++;
+                        if (c == 'e') {
+                            if (stack_.empty() || stack_.back().kind == DICT_VALUE) return Fail("unexpected end of container");
+                            pending_ += stack_.back().kind == LIST ? ']' : '}';
+                            stack_.pop_back();
+                            EndValue();
+                            break;
+                        }
+                        if (!stack_.empty() && stack_.back().kind == DICT_KEY && !digit) return Fail("dictionary key is not a string");
+                        BeginValue();
+                        if (digit) {
+                            state_ = State::Length;
+                            length_ = c - '0';
+                        } else if (c == 'i') {
+                            state_ = State::Integer;
+                            text_.clear();
+                        } else if (c == 'l' || c == 'd') {
+                            if (stack_.size() >= MAX_DEPTH) return Fail("nested too deeply");
+                            stack_.push_back({c == 'l' ? LIST : DICT_KEY, true});
+                            pending_ += c == 'l' ? '[' : '{';
+                        } else {
+                            return Fail("invalid value");
+                        }
+                        break;
+                    case State::Length:
+                        i++;
+                        if (digit) {
+                            // Only the first digit can leave the length at zero.
+                            if (length_ == 0) return Fail("invalid string length");
+                            if (length_ > UINT32_MAX / 10) return Fail("string length out of range");
+                            length_ = length_ * 10 + (c - '0');
+                        } else if (c == ':') {
+                            text_.clear();
+                            state_ = State::StringBody;
+                            if (length_ > INLINE_LIMIT) {
+                                pending_ += "\"hex:";
+                                hex_open_ = true;
+                            }
+                            if (length_ == 0) EndString();
+                        } else {
+                            return Fail("invalid string length");
+                        }
+                        break;
+                    case State::StringBody: {
+                        size_t take = std::min(length_, chunk.size() - i);
+                        std::string_view part = chunk.substr(i, take);
+                        if (hex_open_) AppendHex(part);
+                        else text_.append(part);
+                        i += take;
+                        length_ -= take;
+                        if (length_ == 0) EndString();
+                        break;
+                    }
+                    case State::Integer: {
+                        i++;
+                        if (c != 'e') {
+                            if (text_.size() >= 20) return Fail("invalid integer");
+                            text_ += c;
+                            break;
+                        }
+                        Result<long long> val = BEncoder::ParseInteger(text_, 0, text_.size());
+                        if (!val) return Fail("invalid integer");
+                        pending_ += std::to_string(*val);
+                        EndValue();
+                        break;
+                    }
+                    case State::Done:
+                        break;
+                }
+                if (pending_.size() >= INLINE_LIMIT) Flush();
             }
+            Flush();
+            return state_ == State::Done;
+        }
 
-            if (connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
-                close(sock);
-                freeaddrinfo(res);
-                return -1;
+        bool Complete() const { return state_ == State::Done; }
+
+    private:
+        enum class State { Value, Length, Integer, StringBody, Done };
+        enum Kind : uint8_t { LIST, DICT_KEY, DICT_VALUE };
+        struct Frame {
+            Kind kind;
+            bool first;
+        };
+
+        static constexpr size_t MAX_DEPTH = 512;
+
+        static std::unexpected<Error> Fail(std::string_view detail) { return std::unexpected(Error{Errc::Malformed, detail}); }
+
+        void BeginValue() {
+            if (stack_.empty()) return;
+            Frame& top = stack_.back();
+            if (top.kind == DICT_VALUE) {
+                pending_ += ':';
+                return;
             }
-            freeaddrinfo(res);
-            return sock;
+            if (!top.first) pending_ += ',';
+            top.first = false;
+        }
+
+        void EndValue() {
+            if (stack_.empty()) {
+                state_ = State::Done;
+                return;
+            }
+            state_ = State::Value;
+            if (stack_.back().kind == DICT_KEY) stack_.back().kind = DICT_VALUE;
+            else if (stack_.back().kind == DICT_VALUE) stack_.back().kind = DICT_KEY;
+        }
+
+        // A string longer than INLINE_LIMIT has already been streamed as hex;
+        // a shorter one is still in text_.
+        void EndString() {
+            if (hex_open_) {
+                hex_open_ = false;
+            } else if (ValidUtf8(text_)) {
+                AppendQuoted(text_);
+                EndValue();
+                return;
+            } else {
+                pending_ += "\"hex:";
+                AppendHex(text_);
+            }
+            pending_ += '"';
+            EndValue();
+        }
+
+        void AppendHex(std::string_view bytes) {
+            static const char digits[] = "0123456789abcdef";
+            for (unsigned char c : bytes) {
+                pending_ += digits[c >> 4];
+                pending_ += digits[c & 0xf];
+            }
+        }
+
+        void AppendQuoted(std::string_view text) {
+            static const char digits[] = "0123456789abcdef";
+            pending_ += '"';
+            for (unsigned char c : text) {
+                switch (c) {
+                    case '"': pending_ += "\\\""; break;
+                    case '\\': pending_ += "\\\\"; break;
+                    case '\b': pending_ += "\\b"; break;
+                    case '\f': pending_ += "\\f"; break;
+                    case '\n': pending_ += "\\n"; break;
+                    case '\r': pending_ += "\\r"; break;
+                    case '\t': pending_ += "\\t"; break;
+                    default:
+                        if (c < 0x20) {
+                            pending_ += "\\u00";
+                            pending_ += digits[c >> 4];
+                            pending_ += digits[c & 0xf];
+                        } else {
+                            pending_ += static_cast<char>(c);
+                        }
+                }
+            }
+            pending_ += '"';
+        }
+
+        static bool ValidUtf8(std::string_view s) {
+            size_t i = 0;
+            while (i < s.size()) {
+                unsigned char c = s[i];
+                size_t n;
+                uint32_t cp;
+                if (c < 0x80) { i++; continue; }
+                else if ((c & 0xe0) == 0xc0) { n = 1; cp = c & 0x1f; }
+                else if ((c & 0xf0) == 0xe0) { n = 2; cp = c & 0x0f; }
+                else if ((c & 0xf8) == 0xf0) { n = 3; cp = c & 0x07; }
+                else return false;
+                if (i + n >= s.size()) return false;
+                for (size_t k = 1; k <= n; k++) {
+                    unsigned char cc = s[i + k];
+                    if ((cc & 0xc0) != 0x80) return false;
+                    cp = (cp << 6) | (cc & 0x3f);
+                }
+                static const uint32_t min_cp[] = {0, 0x80, 0x800, 0x10000};
+                if (cp < min_cp[n] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) return false;
+                i += n + 1;
+            }
+            return true;
+        }
+
+        void Flush() {
+            out_.write(pending_.data(), pending_.size());
+            pending_.clear();
+        }
+
+        std::ostream& out_;
+        std::string pending_;
+        std::string text_;
+        bool hex_open_ = false;
+        State state_ = State::Value;
+        std::vector<Frame> stack_;
+        size_t length_ = 0;
+    };
+
+    class BLazyValue;
+
+    // Skip index over a raw bencoded buffer: one linear pass records where
+    // every list and dict ends, and nothing else is materialised. Values are
+    // then looked up on demand through BLazyValue, with whole subtrees (such
+    // as a multi-file torrent's file list) stepped over in O(log n).
+    class BLazyIndex {
+    public:
+        static Result<BLazyIndex> Build(std::string_view s) {
+            if (s.size() > UINT32_MAX) return std::unexpected(Error{Errc::Malformed, "input too large"});
+            BLazyIndex index;
+            index.src_ = s;
+            std::vector<uint32_t> open;
+            size_t pos = 0;
+            do {
+                if (pos >= s.size()) return std::unexpected(Error{Errc::Malformed, "unexpected end of data"});
+                char c = s[pos];
+                if (c == 'l' || c == 'd') {
+                    if (open.size() >= MAX_DEPTH) return std::unexpected(Error{Errc::Malformed, "nested too deeply"});
+                    open.push_back(static_cast<uint32_t>(index.containers_.size()));
+                    index.containers_.push_back({static_cast<uint32_t>(pos), 0});
+                    pos++;
+                } else if (c == 'e') {
+                    if (open.empty()) return std::unexpected(Error{Errc::Malformed, "unexpected end of container"});
+                    index.containers_[open.back()].end = static_cast<uint32_t>(++pos);
+                    open.pop_back();
+                } else {
+                    pos = ScalarEnd(s, pos);
+                    if (pos == std::string_view::npos) return std::unexpected(Error{Errc::Malformed, "invalid value"});
+                }
+            } while (!open.empty());
+            index.end_ = pos;
+            return index;
+        }
+
+        BLazyValue Root() const;
+        std::string_view Source() const { return src_; }
+        size_t ContainerCount() const { return containers_.size(); }
+
+        // End offset of the value starting at `pos`, or npos if malformed.
+        size_t End(size_t pos) const {
+            if (pos >= src_.size()) return std::string_view::npos;
+            if (src_[pos] != 'l' && src_[pos] != 'd') return ScalarEnd(src_, pos);
+            auto it = std::lower_bound(containers_.begin(), containers_.end(), pos,
+                                       [](const Span& span, size_t p) { return span.start < p; });
+            return it != containers_.end() && it->start == pos ? it->end : std::string_view::npos;
+        }
+
+        // End of an integer or string starting at `pos`, or npos.
+        static size_t ScalarEnd(std::string_view s, size_t pos) {
+            if (s[pos] == 'i') {
+                size_t e = s.find('e', pos + 1);
+                if (e == std::string_view::npos || !BEncoder::ParseInteger(s, pos + 1, e)) return std::string_view::npos;
+                return e + 1;
+            }
+            size_t colon = pos;
+            while (colon < s.size() && static_cast<unsigned>(s[colon] - '0') < 10) colon++;
+            if (colon == pos || colon >= s.size() || s[colon] != ':') return std::string_view::npos;
+            Result<long long> len = BEncoder::ParseInteger(s, pos, colon);
+            if (!len || static_cast<size_t>(*len) > s.size() - colon - 1) return std::string_view::npos;
+            return colon + 1 + *len;
+        }
+
+    private:
+        struct Span {
+            uint32_t start;
+            uint32_t end;
+        };
+
+        static constexpr size_t MAX_DEPTH = 512;
+
+        std::string_view src_;
+        std::vector<Span> containers_;
+        size_t end_ = 0;
+    };
+
+    // Handle to one value inside a BLazyIndex. Nothing is decoded until asked
+    // for, and lookups only touch the keys on the path to the wanted value.
+    class BLazyValue {
+    public:
+        BLazyValue() = default;
+        BLazyValue(const BLazyIndex* index, size_t pos) : index_(index), pos_(pos) {}
+
+        explicit operator bool() const { return index_ != nullptr; }
+
+        bool IsInt() const { return Byte() == 'i'; }
+        bool IsString() const { return static_cast<unsigned>(Byte() - '0') < 10; }
+        bool IsList() const { return Byte() == 'l'; }
+        bool IsDict() const { return Byte() == 'd'; }
+
+        BLazyValue Find(std::string_view key) const {
+            if (!IsDict()) return BLazyValue();
+            std::string_view s = index_->Source();
+            size_t p = pos_ + 1;
+            while (p < s.size() && s[p] != 'e') {
+                size_t key_end = BLazyIndex::ScalarEnd(s, p);
+                if (s[p] == 'i' || key_end == std::string_view::npos) throw std::runtime_error("Dictionary key is not a string");
+                if (BLazyValue(index_, p).AsString() == key) return BLazyValue(index_, key_end);
+                p = index_->End(key_end);
+                if (p == std::string_view::npos) throw std::runtime_error("Invalid bencoded string");
+            }
+            return BLazyValue();
+        }
+
+        bool Contains(std::string_view key) const { return static_cast<bool>(Find(key)); }
+
+        BLazyValue At(std::string_view key) const {
+            BLazyValue v = Find(key);
+            if (!v) throw std::runtime_error("Missing key: " + std::string(key));
+            return v;
+        }
+
+        long long AsInt() const {
+            if (!IsInt()) throw std::runtime_error("Bencoded value is not an integer");
+            std::string_view s = Raw();
+            Result<long long> val = BEncoder::ParseInteger(s, 1, s.size() - 1);
+            if (!val) throw std::runtime_error("Invalid integer");
+            return *val;
+        }
+
+        std::string_view AsString() const {
+            if (!IsString()) throw std::runtime_error("Bencoded value is not a string");
+            std::string_view raw = Raw();
+            return raw.substr(raw.find(':') + 1);
+        }
+
+        // The exact encoded bytes of this value.
+        std::string_view Raw() const {
+            size_t end = index_->End(pos_);
+            if (end == std::string_view::npos) throw std::runtime_error("Invalid bencoded string");
+            return index_->Source().substr(pos_, end - pos_);
+        }
+
+    private:
+        char Byte() const { return pos_ < index_->Source().size() ? index_->Source()[pos_] : '\0'; }
+
+        const BLazyIndex* index_ = nullptr;
+        size_t pos_ = 0;
+    };
+
+    inline BLazyValue BLazyIndex::Root() const { return BLazyValue(this, 0); }
+
+    // Forward-only reader over a bencoded buffer, used by BBinder.
+    class BCursor {
+    public:
+        explicit BCursor(std::string_view s) : s_(s) {}
+
+        size_t Pos() const { return pos_; }
+        std::string_view Source() const { return s_; }
+        char Peek() const { return pos_ < s_.size() ? s_[pos_] : '\0'; }
+        void Advance() { pos_++; }
+
+        Result<long long> ReadInt() {
+            if (pos_ >= s_.size()) return std::unexpected(Error{Errc::Malformed, "unexpected end of data"});
+            if (Peek() != 'i') return std::unexpected(Error{Errc::WrongType, ""});
+            size_t end = DigitRunEnd(pos_ + 1);
+            if (end >= s_.size() || s_[end] != 'e') return std::unexpected(Error{Errc::Malformed, "unterminated integer"});
+            Result<long long> val = BEncoder::ParseInteger(s_, pos_ + 1, end);
+            if (!val) return val;
+            pos_ = end + 1;
+            return val;
+        }
+
+        Result<std::string_view> ReadString() {
+            if (pos_ >= s_.size()) return std::unexpected(Error{Errc::Malformed, "unexpected end of data"});
+            if (static_cast<unsigned>(Peek() - '0') >= 10) return std::unexpected(Error{Errc::WrongType, ""});
+            size_t colon = DigitRunEnd(pos_);
+            if (colon >= s_.size() || s_[colon] != ':') return std::unexpected(Error{Errc::Malformed, "invalid string length"});
+            Result<long long> parsed = BEncoder::ParseInteger(s_, pos_, colon);
+            if (!parsed) return std::unexpected(Error{Errc::Malformed, "invalid string length"});
+            size_t len = static_cast<size_t>(*parsed);
+            if (len > s_.size() - colon - 1) return std::unexpected(Error{Errc::Malformed, "string length out of range"});
+            pos_ = colon + 1 + len;
+            return s_.substr(colon + 1, len);
+        }
+
+        Result<void> Skip(int depth = 0) {
+            if (depth > MAX_DEPTH) return std::unexpected(Error{Errc::Malformed, "nested too deeply"});
+            char c = Peek();
+            if (c == 'i') {
+                Result<long long> v = ReadInt();
+                if (!v) return std::unexpected(v.error());
+                return {};
+            }
+            if (c == 'l' || c == 'd') {
+                pos_++;
+                while (Peek() != 'e') {
+                    if (pos_ >= s_.size()) return std::unexpected(Error{Errc::Malformed, "unterminated container"});
+                    Result<void> r = Skip(depth + 1);
+                    if (!r) return r;
+                }
+                pos_++;
+                return {};
+            }
+            Result<std::string_view> str = ReadString();
+            if (!str && str.error().code == Errc::WrongType) return std::unexpected(Error{Errc::Malformed, "invalid value"});
+            if (!str) return std::unexpected(str.error());
+            return {};
+        }
+
+    private:
+        static constexpr int MAX_DEPTH = 512;
+
+        size_t DigitRunEnd(size_t i) const {
+            if (i < s_.size() && s_[i] == '-') i++;
+            while (i < s_.size() && static_cast<unsigned>(s_[i] - '0') < 10) i++;
+            return i;
+        }
+
+        std::string_view s_;
+        size_t pos_ = 0;
+    };
+
+    // Compile-time bencode schemas. A struct is bound by specialising
+    // BSchema<T> with a tuple of BField entries naming each dict key and the
+    // member it fills. Members may be integers, strings, nested schema types,
+    // std::optional of those (optional keys), or BSpanned<T> to also capture
+    // the raw encoding of a nested dict.
+    template <typename T>
+    struct BSchema;
+
+    template <typename T, typename M>
+    struct BField {
+        std::string_view key;
+        M T::*member;
+    };
+
+    template <typename T, typename M>
+    constexpr BField<T, M> Field(std::string_view key, M T::*member) {
+        return {key, member};
+    }
+
+    template <typename T>
+    struct BSpanned {
+        T value{};
+        std::string_view raw;
+    };
+
+    struct InfoDict {
+        long long length = 0;
+        std::optional<std::string_view> name;
+        long long piece_length = 0;
+        std::string_view pieces;
+    };
+
+    struct MetainfoFile {
+        std::string_view announce;
+        BSpanned<InfoDict> info;
+    };
+
+    struct TrackerResponse {
+        std::optional<std::string_view> failure_reason;
+        std::optional<long long> interval;
+        std::optional<std::string_view> peers;
+        std::optional<std::string_view> peers6;
+    };
+
+    struct ExtensionMap {
+        std::optional<long long> ut_metadata;
+    };
+
+    struct ExtensionHandshake {
+        std::optional<ExtensionMap> m;
+        std::optional<long long> metadata_size;
+    };
+
+    struct MetadataMessage {
+        long long msg_type = 0;
+        long long piece = 0;
+        std::optional<long long> total_size;
+    };
+
+    template <>
+    struct BSchema<InfoDict> {
+        static constexpr auto fields = std::make_tuple(
+            Field("length", &InfoDict::length),
+            Field("name", &InfoDict::name),
+            Field("piece length", &InfoDict::piece_length),
+            Field("pieces", &InfoDict::pieces));
+    };
+
+    template <>
+    struct BSchema<MetainfoFile> {
+        static constexpr auto fields = std::make_tuple(
+            Field("announce", &MetainfoFile::announce),
+            Field("info", &MetainfoFile::info));
+    };
+
+    template <>
+    struct BSchema<TrackerResponse> {
+        static constexpr auto fields = std::make_tuple(
+            Field("failure reason", &TrackerResponse::failure_reason),
+            Field("interval", &TrackerResponse::interval),
+            Field("peers", &TrackerResponse::peers),
+            Field("peers6", &TrackerResponse::peers6));
+    };
+
+    template <>
+    struct BSchema<ExtensionMap> {
+        static constexpr auto fields = std::make_tuple(
+            Field("ut_metadata", &ExtensionMap::ut_metadata));
+    };
+
+    template <>
+    struct BSchema<ExtensionHandshake> {
+        static constexpr auto fields = std::make_tuple(
+            Field("m", &ExtensionHandshake::m),
+            Field("metadata_size", &ExtensionHandshake::metadata_size));
+    };
+
+    template <>
+    struct BSchema<MetadataMessage> {
+        static constexpr auto fields = std::make_tuple(
+            Field("msg_type", &MetadataMessage::msg_type),
+            Field("piece", &MetadataMessage::piece),
+            Field("total_size", &MetadataMessage::total_size));
+    };
+
+    // Fills schema-described structs straight from the encoded bytes in one
+    // pass: no DOM is built, keys are matched against the schema's literals,
+    // and unknown keys are skipped. Strings are views into the input.
+    class BBinder {
+    public:
+        template <typename T>
+        static Result<T> Decode(std::string_view s) {
+            size_t end = 0;
+            return Decode<T>(s, end);
+        }
+
+        // Also reports where the value ended, for messages that carry raw data
+        // after a bencoded header.
+        template <typename T>
+        static Result<T> Decode(std::string_view s, size_t& out_end) {
+            BCursor cursor(s);
+            T out{};
+            Result<void> r = Read(cursor, out);
+            if (!r) return std::unexpected(r.error());
+            out_end = cursor.Pos();
+            return out;
+        }
+
+    private:
+        template <typename M>
+        struct IsOptional : std::false_type {};
+
+        template <typename M>
+        struct IsOptional<std::optional<M>> : std::true_type {};
+
+        static Result<void> Read(BCursor& c, long long& out) {
+            Result<long long> v = c.ReadInt();
+            if (!v) return std::unexpected(v.error());
+            out = *v;
+            return {};
+        }
+
+        static Result<void> Read(BCursor& c, std::string_view& out) {
+            Result<std::string_view> v = c.ReadString();
+            if (!v) return std::unexpected(v.error());
+            out = *v;
+            return {};
+        }
+
+        template <typename M>
+        static Result<void> Read(BCursor& c, std::optional<M>& out) {
+            return Read(c, out.emplace());
+        }
+
+        template <typename M>
+        static Result<void> Read(BCursor& c, BSpanned<M>& out) {
+            size_t start = c.Pos();
+            Result<void> r = Read(c, out.value);
+            if (r) out.raw = c.Source().substr(start, c.Pos() - start);
+            return r;
+        }
+
+        template <typename T, size_t N = std::tuple_size_v<decltype(BSchema<T>::fields)>>
+        static Result<void> Read(BCursor& c, T& out) {
+            static_assert(N <= 64, "Too many fields in schema");
+            constexpr auto& fields = BSchema<T>::fields;
+            if (c.Pos() >= c.Source().size()) return std::unexpected(Error{Errc::Malformed, "unexpected end of data"});
+            if (c.Peek() != 'd') return std::unexpected(Error{Errc::WrongType, ""});
+            c.Advance();
+
+            uint64_t seen = 0;
+            while (c.Peek() != 'e') {
+                if (c.Pos() >= c.Source().size()) return std::unexpected(Error{Errc::Malformed, "unterminated dictionary"});
+                Result<std::string_view> key = c.ReadString();
+                if (!key) return std::unexpected(key.error().code == Errc::WrongType ? Error{Errc::Malformed, "dictionary key is not a string"} : key.error());
+
+                bool matched = false;
+                Result<void> r;
+                auto try_field = [&]<size_t I>(std::integral_constant<size_t, I>) {
+                    const auto& field = std::get<I>(fields);
+                    if (matched || field.key != *key) return;
+                    matched = true;
+                    seen |= uint64_t(1) << I;
+                    r = ReadField(c, out.*field.member, field.key);
+                };
+                [&]<size_t... I>(std::index_sequence<I...>) {
+                    (try_field(std::integral_constant<size_t, I>{}), ...);
+                }(std::make_index_sequence<N>{});
+                if (!matched) r = c.Skip();
+                if (!r) return r;
+            }
+            c.Advance();
+
+            std::optional<Error> missing;
+            auto check_field = [&]<size_t I>(std::integral_constant<size_t, I>) {
+                const auto& field = std::get<I>(fields);
+                using Member = std::remove_cvref_t<decltype(out.*field.member)>;
+                if (!missing && !IsOptional<Member>::value && !(seen & (uint64_t(1) << I))) {
+                    missing = Error{Errc::MissingField, field.key};
+                }
+            };
+            [&]<size_t... I>(std::index_sequence<I...>) {
+                (check_field(std::integral_constant<size_t, I>{}), ...);
+            }(std::make_index_sequence<N>{});
+            if (missing) return std::unexpected(*missing);
+            return {};
+        }
+
+        // Names the field in type errors raised directly by its value.
+        template <typename M>
+        static Result<void> ReadField(BCursor& c, M& member, std::string_view key) {
+            Result<void> r = Read(c, member);
+            if (!r && r.error().code == Errc::WrongType && r.error().detail.empty()) return std::unexpected(Error{Errc::WrongType, key});
+            return r;
+        }
+    };
+
+    // Precompiled torrent metadata: a fixed header, the piece hashes packed
+    // back to back in 20-byte records, then the announce URL and name. The
+    // info hash is stored rather than recomputed, so loading one is a bounds
+    // check on a mapping. Integers are in host byte order.
+    class CompiledTorrent {
+    public:
+        static constexpr char MAGIC[8] = {'B', 'T', 'C', 'O', 'M', 'P', 'I', 'L'};
+        static constexpr uint32_t VERSION = 1;
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t announce_length;
+            uint32_t name_length;
+            uint8_t info_hash[20];
+            int64_t length;
+            int64_t piece_length;
+            uint64_t piece_count;
+        };
+        static_assert(sizeof(Header) == 64);
+
+        static bool Matches(std::string_view data) {
+            return data.size() >= sizeof(MAGIC) && std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) == 0;
+        }
+
+        static TorrentInfo Load(std::shared_ptr<MappedFile> mapping) {
+            std::string_view data = mapping->View();
+            if (!Matches(data)) throw std::runtime_error("Not a compiled torrent");
+            if (data.size() < sizeof(Header)) throw std::runtime_error("Truncated compiled torrent");
+            Header h;
+            std::memcpy(&h, data.data(), sizeof(h));
+            if (h.version != VERSION) throw std::runtime_error("Unsupported compiled torrent version " + std::to_string(h.version));
+            size_t body = data.size() - sizeof(Header);
+            if (h.piece_count > body / PIECE_HASH_LEN ||
+                static_cast<uint64_t>(h.announce_length) + h.name_length > body - h.piece_count * PIECE_HASH_LEN) {
+                throw std::runtime_error("Truncated compiled torrent");
+            }
+            // Everything that divides by the piece length relies on these.
+            if (h.length < 0 || h.piece_length <= 0 ||
+                h.piece_count != static_cast<uint64_t>(h.length / h.piece_length + (h.length % h.piece_length != 0))) {
+                throw std::runtime_error("Corrupt compiled torrent");
+            }
+
+            TorrentInfo t;
+            size_t offset = sizeof(Header);
+            t.pieces = data.substr(offset, h.piece_count * PIECE_HASH_LEN);
+            offset += t.pieces.size();
+            t.announce = data.substr(offset, h.announce_length);
+            offset += h.announce_length;
+            t.name = data.substr(offset, h.name_length);
+            t.length = h.length;
+            t.piece_length = h.piece_length;
+            t.info_hash_raw.assign(h.info_hash, h.info_hash + sizeof(h.info_hash));
+            t.info_hash_str = Utils::ToHex(h.info_hash, sizeof(h.info_hash));
+            t.storage = std::move(mapping);
+            return t;
+        }
+
+        static void Write(const TorrentInfo& t, const std::string& path) {
+            Header h{};
+            std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+            h.version = VERSION;
+            h.announce_length = static_cast<uint32_t>(t.announce.size());
+            h.name_length = static_cast<uint32_t>(t.name.size());
+            std::memcpy(h.info_hash, t.info_hash_raw.data(), sizeof(h.info_hash));
+            h.length = t.length;
+            h.piece_length = t.piece_length;
+            h.piece_count = t.pieces.size() / PIECE_HASH_LEN;
+
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            if (!out) throw std::runtime_error("Cannot open file: " + path);
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.write(t.pieces.data(), h.piece_count * PIECE_HASH_LEN);
+            out.write(t.announce.data(), t.announce.size());
+            out.write(t.name.data(), t.name.size());
+            if (!out.flush()) throw std::runtime_error("Cannot write file: " + path);
+        }
+    };
+
+    // Bytes per second with a burst allowance. Reserve() always grants the
+    // bytes, going into debt if it has to, and returns how long the caller
+    // should wait before moving them, so throttled paths sleep or set a
+    // timer instead of polling. A rate of 0 is unlimited. The rate may be
+    // changed from any thread while the bucket is in use.
+    class TokenBucket {
+    public:
+        // The default burst is a tenth of a second's worth, and at least two
+        // blocks.
+        void SetRate(double bytes_per_second, double burst = 0) {
+            std::lock_guard lock(mutex_);
+            auto now = std::chrono::steady_clock::now();
+            Refill(now);
+            bool was_unlimited = rate_ <= 0;
+            rate_ = bytes_per_second;
+            burst_ = burst > 0 ? burst : std::max(bytes_per_second / 10, 2.0 * BLOCK_SIZE);
+            tokens_ = was_unlimited ? burst_ : std::min(tokens_, burst_);
+        }
+
+        double Rate() {
+            std::lock_guard lock(mutex_);
+            return rate_;
+        }
+
+        std::chrono::nanoseconds Reserve(size_t bytes) {
+            std::lock_guard lock(mutex_);
+            if (rate_ <= 0) return {};
+            Refill(std::chrono::steady_clock::now());
+            tokens_ -= static_cast<double>(bytes);
+            if (tokens_ >= 0) return {};
+            return std::chrono::nanoseconds(static_cast<long long>(-tokens_ / rate_ * 1e9));
+        }
+
+    private:
+        void Refill(std::chrono::steady_clock::time_point now) {
+            if (rate_ > 0) tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+            last_ = now;
+        }
+
+        std::mutex mutex_;
+        double rate_ = 0;
+        double burst_ = 0;
+        double tokens_ = 0;
+        std::chrono::steady_clock::time_point last_ = std::chrono::steady_clock::now();
+    };
+
+    // Upload and download limits for one scope: the process, a torrent or a
+    // peer. Traffic is charged to the global scope and to its torrent and
+    // peer, and waits for whichever of them is furthest behind. Torrent and
+    // peer scopes are created on first use with the rates last given to
+    // SetTorrentRates or SetPeerRates, which also update existing scopes.
+    // They live while a handle to them is held, normally by the connections
+    // they limit, so a scope goes away once its last connection closes.
+    class Bandwidth {
+    public:
+        using Handle = std::shared_ptr<Bandwidth>;
+
+        TokenBucket upload;
+        TokenBucket download;
+
+        static Bandwidth& Global() {
+            static Bandwidth global;
+            return global;
+        }
+
+        static Handle Torrent(const std::string& info_hash) { return Scope(Torrents(), info_hash); }
+        static Handle Peer(const std::string& address) { return Scope(Peers(), address); }
+
+        static void SetTorrentRates(double upload, double download) { SetRates(Torrents(), upload, download); }
+        static void SetPeerRates(double upload, double download) { SetRates(Peers(), upload, download); }
+
+        static std::chrono::nanoseconds ReserveDownload(size_t bytes, Bandwidth* torrent, Bandwidth* peer) {
+            return Reserve(&Bandwidth::download, bytes, torrent, peer);
+        }
+
+        static std::chrono::nanoseconds ReserveUpload(size_t bytes, Bandwidth* torrent, Bandwidth* peer) {
+            return Reserve(&Bandwidth::upload, bytes, torrent, peer);
+        }
+
+    private:
+        struct Registry {
+            std::mutex mutex;
+            std::unordered_map<std::string, std::weak_ptr<Bandwidth>> scopes;
+            double upload = 0;
+            double download = 0;
+        };
+
+        static Registry& Torrents() {
+            static Registry registry;
+            return registry;
+        }
+
+        static Registry& Peers() {
+            static Registry registry;
+            return registry;
+        }
+
+        static Handle Scope(Registry& registry, const std::string& key) {
+            std::lock_guard lock(registry.mutex);
+            std::weak_ptr<Bandwidth>& slot = registry.scopes[key];
+            if (Handle scope = slot.lock()) return scope;
+            Handle scope(new Bandwidth(), [&registry, key](Bandwidth* b) {
+                std::lock_guard lock(registry.mutex);
+                auto it = registry.scopes.find(key);
+                // The key may already name a newer scope.
+                if (it != registry.scopes.end() && it->second.expired()) registry.scopes.erase(it);
+                delete b;
+            });
+            scope->upload.SetRate(registry.upload);
+            scope->download.SetRate(registry.download);
+            slot = scope;
+            return scope;
+        }
+
+        static void SetRates(Registry& registry, double upload, double download) {
+            std::vector<Handle> scopes;
+            {
+                std::lock_guard lock(registry.mutex);
+                registry.upload = upload;
+                registry.download = download;
+                for (auto& [key, slot] : registry.scopes) {
+                    if (Handle scope = slot.lock()) scopes.push_back(std::move(scope));
+                }
+            }
+            // Outside the lock: dropping the last handle to a scope takes it.
+            for (const Handle& scope : scopes) {
+                scope->upload.SetRate(upload);
+                scope->download.SetRate(download);
+            }
+        }
+
+        static std::chrono::nanoseconds Reserve(TokenBucket Bandwidth::*bucket, size_t bytes, Bandwidth* torrent, Bandwidth* peer) {
+            std::chrono::nanoseconds wait = (Global().*bucket).Reserve(bytes);
+            if (torrent) wait = std::max(wait, (torrent->*bucket).Reserve(bytes));
+            if (peer) wait = std::max(wait, (peer->*bucket).Reserve(bytes));
+            return wait;
+        }
+    };
+
+    // TCP options for peer and tracker sockets, set before they connect so
+    // the buffer sizes are reflected in the advertised window.
+    struct SocketProfile {
+        // Requests and haves are already coalesced by FramedWriter and the
+        // event loops' outboxes, so Nagle only adds delay.
+        bool no_delay = true;
+        // 0 leaves the kernel's buffer autotuning in charge; a fixed size
+        // turns it off for that socket.
+        int receive_buffer = 0;
+        int send_buffer = 0;
+        // Only set at connect time: the kernel may drop back to delayed
+        // ACKs later in the connection.
+        bool quick_ack = false;
+        // Caps how much unsent data may sit in the send buffer, so queued
+        // requests stay in user space where they can still be reordered.
+        int notsent_lowat = 0;
+
+        // Bytes in flight needed to fill a path of `megabits` per second
+        // with a round-trip time of `rtt_ms`.
+        static int BdpBytes(double megabits, double rtt_ms) {
+            return static_cast<int>(std::min(megabits * 1e6 / 8 * rtt_ms / 1e3, 1e9));
+        }
+
+        // "kernel" sets nothing, "default" only TCP_NODELAY, "latency" adds
+        // quick ACKs and a small unsent limit, and "bulk" sizes the buffers
+        // for 1 Gbit/s over 100 ms.
+        static SocketProfile Named(std::string_view name) {
+            SocketProfile p;
+            if (name == "kernel") {
+                p.no_delay = false;
+            } else if (name == "latency") {
+                p.quick_ack = true;
+                p.notsent_lowat = 16 * 1024;
+            } else if (name == "bulk") {
+                p.receive_buffer = p.send_buffer = BdpBytes(1000, 100);
+                p.notsent_lowat = 128 * 1024;
+            } else if (name != "default") {
+                throw std::runtime_error("Unknown socket profile: " + std::string(name));
+            }
+            return p;
+        }
+
+        void Apply(int sock) const {
+            int on = 1;
+            if (no_delay) setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            if (quick_ack) setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+            if (receive_buffer > 0) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+            if (send_buffer > 0) setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+            if (notsent_lowat > 0) setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat, sizeof(notsent_lowat));
+        }
+    };
+
+    struct SocketAddress {
+        sockaddr_storage storage{};
+        socklen_t length = 0;
+
+        const sockaddr* Get() const { return reinterpret_cast<const sockaddr*>(&storage); }
+    };
+
+    // Resolves host names on a worker thread and keeps each answer for
+    // `ttl`, so repeated announces to the same tracker skip the lookup.
+    // getaddrinfo does not report record TTLs, so one fixed TTL applies to
+    // every host; failed lookups are kept for a shorter time. Concurrent
+    // requests for a host that is still being resolved share one lookup.
+    class Resolver {
+    public:
+        using Addresses = std::vector<SocketAddress>;
+        using LookupFunction = std::function<Addresses(const std::string& host, const std::string& port)>;
+        using Clock = std::function<std::chrono::steady_clock::time_point()>;
+
+        static constexpr std::chrono::seconds TTL{300};
+        static constexpr std::chrono::seconds FAILURE_TTL{10};
+
+        // `lookup` and `clock` stand in for getaddrinfo and the steady clock
+        // in tests.
+        explicit Resolver(std::chrono::seconds ttl = TTL, LookupFunction lookup = Lookup, Clock clock = std::chrono::steady_clock::now)
+            : ttl_(ttl), lookup_(std::move(lookup)), clock_(std::move(clock)) {}
+
+        ~Resolver() {
+            {
+                std::lock_guard lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            if (worker_.joinable()) worker_.join();
+        }
+
+        Resolver(const Resolver&) = delete;
+        Resolver& operator=(const Resolver&) = delete;
+
+        // The resolver every Network function uses.
+        static Resolver& Shared() {
+            static Resolver resolver;
+            return resolver;
+        }
+
+        // Returns at once; the future is already ready on a cache hit. An
+        // empty result means the lookup failed.
+        std::shared_future<Addresses> Resolve(const std::string& host, const std::string& port) {
+            std::string key = host + ":" + port;
+            std::lock_guard lock(mutex_);
+            auto now = clock_();
+            auto it = cache_.find(key);
+            if (it != cache_.end() && (it->second.pending || now < it->second.expires)) {
+                hits_++;
+                return it->second.result;
+            }
+            std::promise<Addresses> promise;
+            cache_[key] = {promise.get_future().share(), {}, true};
+            queue_.push_back({key, host, port, std::move(promise)});
+            if (!worker_.joinable()) worker_ = std::thread([this] { Work(); });
+            wake_.notify_one();
+            return cache_[key].result;
+        }
+
+        // Number of Resolve calls served without a new lookup.
+        size_t Hits() {
+            std::lock_guard lock(mutex_);
+            return hits_;
+        }
+
+        void Clear() {
+            std::lock_guard lock(mutex_);
+            std::erase_if(cache_, [](const auto& entry) { return !entry.second.pending; });
+        }
+
+    private:
+        struct Entry {
+            std::shared_future<Addresses> result;
+            std::chrono::steady_clock::time_point expires;
+            bool pending;
+        };
+
+        struct Request {
+            std::string key;
+            std::string host;
+            std::string port;
+            std::promise<Addresses> promise;
+        };
+
+        static Addresses Lookup(const std::string& host, const std::string& port) {
+            addrinfo hints{}, *res;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            Addresses out;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return out;
+            for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+                SocketAddress a;
+                std::memcpy(&a.storage, ai->ai_addr, ai->ai_addrlen);
+                a.length = ai->ai_addrlen;
+                out.push_back(a);
+            }
+            freeaddrinfo(res);
+            return out;
+        }
+
+        void Work() {
+            std::unique_lock lock(mutex_);
+            while (true) {
+                wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (stop_) return;
+                Request request = std::move(queue_.front());
+                queue_.pop_front();
+
+                lock.unlock();
+                Addresses found = lookup_(request.host, request.port);
+                lock.lock();
+
+                Entry& entry = cache_[request.key];
+                entry.pending = false;
+                entry.expires = clock_() + (found.empty() ? FAILURE_TTL : ttl_);
+                request.promise.set_value(std::move(found));
+            }
+        }
+
+        std::chrono::seconds ttl_;
+        LookupFunction lookup_;
+        Clock clock_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::deque<Request> queue_;
+        std::unordered_map<std::string, Entry> cache_;
+        size_t hits_ = 0;
+        bool stop_ = false;
+        std::thread worker_;
+    };
+
+    enum class Transport { Tcp, Utp };
+
+    class Network {
+    public:
+        // Applied to every socket the functions below create.
+        static inline SocketProfile profile;
+        // What peer connections run over; trackers always use TCP.
+        static inline Transport peer_transport = Transport::Tcp;
+
+       static int Connect(const std::string& ip, uint16_t port) {
+            std::optional<SocketAddress> addr = ParseAddress(ip, port);
+            if (!addr) return -1;
+            int sock = socket(addr->storage.ss_family, SOCK_STREAM, 0);
+            if (sock < 0) throw std::runtime_error("Socket creation failed");
+
+            SetBlocking(sock);
+            profile.Apply(sock);
+
+            if (connect(sock, addr->Get(), addr->length) < 0) {
+                close(sock);
+                return -1;
+            }
+            return sock;
+        }
+
+        // Accepts a dotted quad or an IPv6 address without brackets.
+        static std::optional<SocketAddress> ParseAddress(const std::string& ip, uint16_t port) {
+            SocketAddress a;
+            auto* v4 = reinterpret_cast<sockaddr_in*>(&a.storage);
+            if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+                v4->sin_family = AF_INET;
+                v4->sin_port = htons(port);
+                a.length = sizeof(sockaddr_in);
+                return a;
+            }
+            auto* v6 = reinterpret_cast<sockaddr_in6*>(&a.storage);
+            if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+                v6->sin6_family = AF_INET6;
+                v6->sin6_port = htons(port);
+                a.length = sizeof(sockaddr_in6);
+                return a;
+            }
+            return std::nullopt;
+        }
+
+        // Splits "host:port" or "[v6-address]:port"; the port is empty if
+        // there is none.
+        static std::pair<std::string, std::string> SplitHostPort(std::string_view s) {
+            if (!s.empty() && s[0] == '[') {
+                size_t close = s.find(']');
+                if (close == std::string_view::npos) return {std::string(s), ""};
+                std::string_view rest = s.substr(close + 1);
+                return {std::string(s.substr(1, close - 1)), rest.size() > 1 && rest[0] == ':' ? std::string(rest.substr(1)) : ""};
+            }
+            size_t colon = s.rfind(':');
+            // More than one colon without brackets is a bare IPv6 address.
+            if (colon == std::string_view::npos || s.find(':') != colon) return {std::string(s), ""};
+            return {std::string(s.substr(0, colon)), std::string(s.substr(colon + 1))};
+        }
+
+        // An IPv4 or IPv6 address as "ip:port" or "[ip]:port".
+        static std::string Name(const SocketAddress& a) {
+            char ip[INET6_ADDRSTRLEN] = "";
+            const void* raw = a.storage.ss_family == AF_INET6 ? static_cast<const void*>(&reinterpret_cast<const sockaddr_in6*>(&a.storage)->sin6_addr)
+                                                              : static_cast<const void*>(&reinterpret_cast<const sockaddr_in*>(&a.storage)->sin_addr);
+            inet_ntop(a.storage.ss_family, raw, ip, sizeof(ip));
+            return FormatHostPort(ip, ntohs(reinterpret_cast<const sockaddr_in*>(&a.storage)->sin_port));
+        }
+
+        static std::string FormatHostPort(const std::string& host, uint16_t port) {
+            if (host.find(':') != std::string::npos) return "[" + host + "]:" + std::to_string(port);
+            return host + ":" + std::to_string(port);
+        }
+
+
+        // Puts a socket in the mode the blocking peer code expects: no
+        // O_NONBLOCK, and 10-second send and receive timeouts.
+        static void SetBlocking(int sock) {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+            struct timeval tv;
+            tv.tv_sec = 10;
+            tv.tv_usec = 0;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+        }
+
+        // Starts a connect on a non-blocking socket and returns it without
+        // waiting; the caller learns the outcome from writability and
+        // SO_ERROR. Returns -1 if the attempt failed immediately.
+        static int ConnectNonBlocking(const sockaddr* addr, socklen_t addr_len) {
+            int sock = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (sock < 0) return -1;
+            profile.Apply(sock);
+            if (connect(sock, addr, addr_len) < 0 && errno != EINPROGRESS) {
+                close(sock);
+                return -1;
+            }
+            return sock;
+        }
+
+        static int ConnectNonBlocking(const std::string& ip, uint16_t port) {
+            std::optional<SocketAddress> addr = ParseAddress(ip, port);
+            if (!addr) return -1;
+            return ConnectNonBlocking(addr->Get(), addr->length);
+        }
+
+        static void SendAll(int sock, const void* data, size_t len) {
+            const char* ptr = static_cast<const char*>(data);
+            while (len > 0) {
+                ssize_t n = send(sock, ptr, len, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) throw std::runtime_error("Send failed");
+                ptr += n;
+                len -= n;
+            }
+        }
+
+        // One recv that retries on EINTR. A closed connection and a socket
+        // error, such as a receive timeout, are reported apart.
+        static Result<size_t> Recv(int sock, void* buffer, size_t len) {
+            while (true) {
+                ssize_t r = recv(sock, buffer, len, 0);
+                if (r > 0) return static_cast<size_t>(r);
+                if (r == 0) return std::unexpected(Error{Errc::ConnectionClosed, {}});
+                if (errno != EINTR) return std::unexpected(Error{Errc::Io, "Receive", errno});
+            }
+        }
+
+        static Result<void> RecvAll(int sock, void* buffer, size_t len) {
+            size_t received = 0;
+            uint8_t* ptr = static_cast<uint8_t*>(buffer);
+            while (received < len) {
+                Result<size_t> r = Recv(sock, ptr + received, len - received);
+                if (!r) return std::unexpected(r.error());
+                received += *r;
+            }
+            return {};
+        }
+
+        // Reads and drops `len` bytes without allocating.
+        static Result<void> Discard(int sock, size_t len) {
+            char buf[4096];
+            while (len > 0) {
+                size_t n = std::min(len, sizeof(buf));
+                Result<void> r = RecvAll(sock, buf, n);
+                if (!r) return r;
+                len -= n;
+            }
+            return {};
+        }
+    };
+
+    // The peer wire protocol's messages: BEP 3, the BEP 6 fast extension and
+    // BEP 10's extended message. Encode writes a message, length prefix
+    // included, into a std::array, so fixed-size messages never touch the
+    // heap. For piece, bitfield and extended messages it writes the header
+    // only, with a length that covers `payload`, which is sent after it.
+    // Decode takes a message without its length prefix, as ReadMessage
+    // returns it; payloads borrow from that buffer.
+    class PeerWire {
+    public:
+        enum class Id : uint8_t {
+            Choke = 0,
+            Unchoke = 1,
+            Interested = 2,
+            NotInterested = 3,
+            Have = 4,
+            Bitfield = 5,
+            Request = 6,
+            Piece = 7,
+            Cancel = 8,
+            Port = 9,
+            SuggestPiece = 13,
+            HaveAll = 14,
+            HaveNone = 15,
+            RejectRequest = 16,
+            AllowedFast = 17,
+            Extended = 20,
+        };
+
+        using Bytes = std::span<const uint8_t>;
+
+        struct KeepAlive {};
+
+        template <Id N>
+        struct Empty {
+            static constexpr Id ID = N;
+            static constexpr size_t SIZE = 5;
+            void Put(uint8_t*) const {}
+            void Get(Bytes) {}
+        };
+
+        template <Id N>
+        struct PieceIndex {
+            static constexpr Id ID = N;
+            static constexpr size_t SIZE = 9;
+            uint32_t piece = 0;
+            void Put(uint8_t* out) const { Utils::Put32(out, piece); }
+            void Get(Bytes in) { piece = Utils::Get32(in.data()); }
+        };
+
+        template <Id N>
+        struct Block {
+            static constexpr Id ID = N;
+            static constexpr size_t SIZE = 17;
+            uint32_t piece = 0;
+            uint32_t begin = 0;
+            uint32_t length = 0;
+            void Put(uint8_t* out) const {
+                Utils::Put32(out, piece);
+                Utils::Put32(out + 4, begin);
+                Utils::Put32(out + 8, length);
+            }
+            void Get(Bytes in) {
+                piece = Utils::Get32(in.data());
+                begin = Utils::Get32(in.data() + 4);
+                length = Utils::Get32(in.data() + 8);
+            }
+        };
+
+        using Choke = Empty<Id::Choke>;
+        using Unchoke = Empty<Id::Unchoke>;
+        using Interested = Empty<Id::Interested>;
+        using NotInterested = Empty<Id::NotInterested>;
+        using HaveAll = Empty<Id::HaveAll>;
+        using HaveNone = Empty<Id::HaveNone>;
+        using Have = PieceIndex<Id::Have>;
+        using SuggestPiece = PieceIndex<Id::SuggestPiece>;
+        using AllowedFast = PieceIndex<Id::AllowedFast>;
+        using Request = Block<Id::Request>;
+        using Cancel = Block<Id::Cancel>;
+        using RejectRequest = Block<Id::RejectRequest>;
+
+        struct Port {
+            static constexpr Id ID = Id::Port;
+            static constexpr size_t SIZE = 7;
+            uint16_t port = 0;
+            void Put(uint8_t* out) const { Utils::Put16(out, port); }
+            void Get(Bytes in) { port = Utils::Get16(in.data()); }
+        };
+
+        // Decoding only the first 9 bytes gives the header alone, for
+        // readers that put the block itself somewhere else.
+        struct Piece {
+            static constexpr Id ID = Id::Piece;
+            static constexpr size_t SIZE = 13;
+            uint32_t piece = 0;
+            uint32_t begin = 0;
+            Bytes payload;
+            void Put(uint8_t* out) const {
+                Utils::Put32(out, piece);
+                Utils::Put32(out + 4, begin);
+            }
+            void Get(Bytes in) {
+                piece = Utils::Get32(in.data());
+                begin = Utils::Get32(in.data() + 4);
+                payload = in.subspan(8);
+            }
+        };
+
+        struct Bitfield {
+            static constexpr Id ID = Id::Bitfield;
+            static constexpr size_t SIZE = 5;
+            Bytes payload;
+            void Put(uint8_t*) const {}
+            void Get(Bytes in) { payload = in; }
+        };
+
+        // `extension` 0 is the extension handshake; other values are the ids
+        // the receiver assigned in its handshake.
+        struct Extended {
+            static constexpr Id ID = Id::Extended;
+            static constexpr size_t SIZE = 6;
+            uint8_t extension = 0;
+            Bytes payload;
+            void Put(uint8_t* out) const { out[0] = extension; }
+            void Get(Bytes in) {
+                extension = in[0];
+                payload = in.subspan(1);
+            }
+        };
+
+        struct Handshake {
+            // Reserved bits: reserved[5] for BEP 10, reserved[7] for BEP 6.
+            static constexpr uint8_t EXTENSION_PROTOCOL = 0x10;
+            static constexpr uint8_t FAST_EXTENSION = 0x04;
+
+            std::array<uint8_t, 8> reserved{};
+            std::array<uint8_t, 20> info_hash{};
+            std::array<uint8_t, 20> peer_id{};
+
+            bool Extensions() const { return reserved[5] & EXTENSION_PROTOCOL; }
+            bool Fast() const { return reserved[7] & FAST_EXTENSION; }
+        };
+
+        using Message = std::variant<KeepAlive, Choke, Unchoke, Interested, NotInterested, Have, Bitfield, Request, Piece, Cancel, Port,
+                                     SuggestPiece, HaveAll, HaveNone, RejectRequest, AllowedFast, Extended>;
+
+        template <typename M>
+        static std::array<uint8_t, M::SIZE> Encode(const M& m) {
+            std::array<uint8_t, M::SIZE> out;
+            size_t payload = 0;
+            if constexpr (requires { m.payload; }) payload = m.payload.size();
+            Utils::Put32(out.data(), static_cast<uint32_t>(M::SIZE - 4 + payload));
+            out[4] = static_cast<uint8_t>(M::ID);
+            m.Put(out.data() + 5);
+            return out;
+        }
+
+        static std::array<uint8_t, HANDSHAKE_LEN> Encode(const Handshake& h) {
+            std::array<uint8_t, HANDSHAKE_LEN> out;
+            out[0] = static_cast<uint8_t>(PROTOCOL.size());
+            std::memcpy(out.data() + 1, PROTOCOL.data(), PROTOCOL.size());
+            std::memcpy(out.data() + 20, h.reserved.data(), 8);
+            std::memcpy(out.data() + 28, h.info_hash.data(), 20);
+            std::memcpy(out.data() + 48, h.peer_id.data(), 20);
+            return out;
+        }
+
+        template <typename M>
+        static Result<M> Decode(Bytes msg) {
+            constexpr size_t body = M::SIZE - 4;
+            if (msg.empty() || msg[0] != static_cast<uint8_t>(M::ID)) return std::unexpected(Error{Errc::Protocol, "unexpected message id"});
+            constexpr bool variable = requires(M m) { m.payload; };
+            if (variable ? msg.size() < body : msg.size() != body) return std::unexpected(Error{Errc::Protocol, "bad message length"});
+            M m;
+            m.Get(msg.subspan(1));
+            return m;
+        }
+
+        // Any message. Ids this codec does not know are a Protocol error,
+        // which callers may skip.
+        static Result<Message> Decode(Bytes msg) {
+            if (msg.empty()) return KeepAlive{};
+            switch (static_cast<Id>(msg[0])) {
+                case Id::Choke: return As<Choke>(msg);
+                case Id::Unchoke: return As<Unchoke>(msg);
+                case Id::Interested: return As<Interested>(msg);
+                case Id::NotInterested: return As<NotInterested>(msg);
+                case Id::Have: return As<Have>(msg);
+                case Id::Bitfield: return As<Bitfield>(msg);
+                case Id::Request: return As<Request>(msg);
+                case Id::Piece: return As<Piece>(msg);
+                case Id::Cancel: return As<Cancel>(msg);
+                case Id::Port: return As<Port>(msg);
+                case Id::SuggestPiece: return As<SuggestPiece>(msg);
+                case Id::HaveAll: return As<HaveAll>(msg);
+                case Id::HaveNone: return As<HaveNone>(msg);
+                case Id::RejectRequest: return As<RejectRequest>(msg);
+                case Id::AllowedFast: return As<AllowedFast>(msg);
+                case Id::Extended: return As<Extended>(msg);
+            }
+            return std::unexpected(Error{Errc::Protocol, "unknown message id"});
+        }
+
+        static Result<Handshake> DecodeHandshake(Bytes in) {
+            if (in.size() != HANDSHAKE_LEN || in[0] != PROTOCOL.size() || std::memcmp(in.data() + 1, PROTOCOL.data(), PROTOCOL.size()) != 0) {
+                return std::unexpected(Error{Errc::Protocol, "not a BitTorrent handshake"});
+            }
+            Handshake h;
+            std::memcpy(h.reserved.data(), in.data() + 20, 8);
+            std::memcpy(h.info_hash.data(), in.data() + 28, 20);
+            std::memcpy(h.peer_id.data(), in.data() + 48, 20);
+            return h;
+        }
+
+        static Bytes View(std::string_view s) { return {reinterpret_cast<const uint8_t*>(s.data()), s.size()}; }
+
+    private:
+        static constexpr std::string_view PROTOCOL = "BitTorrent protocol";
+
+        template <typename M>
+        static Result<Message> As(Bytes msg) {
+            Result<M> m = Decode<M>(msg);
+            if (!m) return std::unexpected(m.error());
+            return *m;
+        }
+    };
+
+    // Buffers the receive side of a peer connection. Each recv asks for as
+    // much as the buffer can hold, so a run of small messages, or the
+    // length, id and header fields of one piece message, are usually served
+    // from memory instead of costing a syscall each. Reads larger than a
+    // quarter of the buffer bypass it once the buffered bytes are used up.
+    // The reader does not own the socket.
+    class FramedReader {
+    public:
+        static constexpr size_t CAPACITY = 64 * 1024;
+
+        // A capacity of 0 sends every read straight to recv.
+        explicit FramedReader(int sock, size_t capacity = CAPACITY) : sock_(sock), buffer_(capacity) {}
+
+        int Socket() const { return sock_; }
+
+        // Download limits, besides the global one, for what is requested
+        // over this connection. The reader holds the scopes while it lives.
+        void Throttle(Bandwidth::Handle torrent, Bandwidth::Handle peer) {
+            torrent_ = std::move(torrent);
+            peer_ = std::move(peer);
+        }
+
+        Bandwidth* TorrentLimit() const { return torrent_.get(); }
+        Bandwidth* PeerLimit() const { return peer_.get(); }
+
+        // Number of recv calls made so far.
+        size_t Receives() const { return receives_; }
+
+        // Bytes already received but not yet read.
+        size_t Buffered() const { return tail_ - head_; }
+
+        Result<void> Read(void* out, size_t len) {
+            uint8_t* dst = static_cast<uint8_t*>(out);
+            while (len > 0) {
+                if (head_ == tail_) {
+                    if (len >= buffer_.size() / 4) return Receive(dst, len);
+                    Result<void> r = Fill();
+                    if (!r) return r;
+                }
+                size_t n = std::min(len, tail_ - head_);
+                std::memcpy(dst, buffer_.data() + head_, n);
+                head_ += n;
+                dst += n;
+                len -= n;
+            }
+            return {};
+        }
+
+        Result<void> Discard(size_t len) {
+            while (len > 0) {
+                if (head_ == tail_) {
+                    if (buffer_.empty()) {
+                        uint8_t scratch[4096];
+                        size_t n = std::min(len, sizeof(scratch));
+                        Result<void> r = Receive(scratch, n);
+                        if (!r) return r;
+                        len -= n;
+                        continue;
+                    }
+                    Result<void> r = Fill();
+                    if (!r) return r;
+                }
+                size_t n = std::min(len, tail_ - head_);
+                head_ += n;
+                len -= n;
+            }
+            return {};
+        }
+
+    private:
+        Result<void> Fill() {
+            head_ = tail_ = 0;
+            Result<size_t> n = Network::Recv(sock_, buffer_.data(), buffer_.size());
+            receives_++;
+            if (!n) return std::unexpected(n.error());
+            tail_ = *n;
+            return {};
+        }
+
+        Result<void> Receive(uint8_t* dst, size_t len) {
+            while (len > 0) {
+                Result<size_t> n = Network::Recv(sock_, dst, len);
+                receives_++;
+                if (!n) return std::unexpected(n.error());
+                dst += *n;
+                len -= *n;
+            }
+            return {};
+        }
+
+        int sock_;
+        std::vector<uint8_t> buffer_;
+        size_t head_ = 0;
+        size_t tail_ = 0;
+        size_t receives_ = 0;
+        Bandwidth::Handle torrent_;
+        Bandwidth::Handle peer_;
+    };
+
+    // Queues outgoing messages for a peer socket and sends everything queued
+    // with one sendmsg per Flush, picking up where a short write left off.
+    // Push copies the bytes; Borrow queues a payload in place, which must
+    // stay valid until the next Flush. Each Flush is charged to the upload
+    // limits and sleeps first if they are exhausted. The writer does not own
+    // the socket.
+    class FramedWriter {
+    public:
+        explicit FramedWriter(int sock) : sock_(sock) {}
+
+        // Charges uploads to `torrent` and `peer` as well as the global limit.
+        void Throttle(Bandwidth* torrent, Bandwidth* peer) {
+            torrent_ = torrent;
+            peer_ = peer;
+        }
+
+        // Number of sendmsg calls made so far.
+        size_t Sends() const { return sends_; }
+
+        bool Empty() const { return segments_.empty(); }
+
+        void Push(const void* data, size_t len) {
+            if (segments_.empty() || segments_.back().borrowed) segments_.push_back({nullptr, bytes_.size(), 0});
+            segments_.back().len += len;
+            bytes_.append(static_cast<const char*>(data), len);
+        }
+
+        void Borrow(const void* data, size_t len) {
+            segments_.push_back({static_cast<const char*>(data), 0, len});
+        }
+
+        Result<void> Flush() {
+            std::vector<iovec> iov;
+            iov.reserve(segments_.size());
+            size_t total = 0;
+            for (const Segment& seg : segments_) {
+                const char* base = seg.borrowed ? seg.borrowed : bytes_.data() + seg.offset;
+                iov.push_back({const_cast<char*>(base), seg.len});
+                total += seg.len;
+            }
+            segments_.clear();
+            std::this_thread::sleep_for(Bandwidth::ReserveUpload(total, torrent_, peer_));
+            size_t first = 0;
+            while (first < iov.size()) {
+                msghdr mh{};
+                mh.msg_iov = iov.data() + first;
+                mh.msg_iovlen = std::min(iov.size() - first, MAX_IOVECS);
+                ssize_t n = sendmsg(sock_, &mh, MSG_NOSIGNAL);
+                sends_++;
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    bytes_.clear();
+                    if (n < 0) return std::unexpected(Error{Errc::Io, "Send", errno});
+                    return std::unexpected(Error{Errc::ConnectionClosed, {}});
+                }
+                // Skip whatever part of the iovecs went out.
+                size_t sent = n;
+                while (first < iov.size() && sent >= iov[first].iov_len) sent -= iov[first++].iov_len;
+                if (first < iov.size()) {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + sent;
+                    iov[first].iov_len -= sent;
+                }
+            }
+            bytes_.clear();
+            return {};
+        }
+
+    private:
+        static constexpr size_t MAX_IOVECS = 1024;
+
+        struct Segment {
+            const char* borrowed;
+            size_t offset;
+            size_t len;
+        };
+
+        int sock_;
+        std::string bytes_;
+        std::vector<Segment> segments_;
+        size_t sends_ = 0;
+        Bandwidth* torrent_ = nullptr;
+        Bandwidth* peer_ = nullptr;
+    };
+
+    // Fixed-size datagram buffers recycled through a free list, so the uTP
+    // send, reorder and delay queues do not allocate per packet. Only the
+    // engine thread uses a pool.
+    class PacketPool {
+    public:
+        static constexpr size_t PACKET_SIZE = 1500;
+
+        struct Packet {
+            uint8_t data[PACKET_SIZE];
+            size_t len = 0;
+            size_t payload = 0;
+            uint16_t seq = 0;
+            int transmissions = 0;
+            bool resend = false;
+            bool sacked = false;
+            // When it was last sent, or for a delayed datagram when it is due.
+            std::chrono::steady_clock::time_point time;
+            SocketAddress to;
+        };
+
+        Packet* Get() {
+            if (free_.empty()) {
+                chunks_.push_back(std::make_unique<Packet[]>(CHUNK));
+                for (size_t i = 0; i < CHUNK; i++) free_.push_back(&chunks_.back()[i]);
+            }
+            Packet* p = free_.back();
+            free_.pop_back();
+            p->len = p->payload = 0;
+            p->transmissions = 0;
+            p->resend = p->sacked = false;
+            return p;
+        }
+
+        void Put(Packet* p) { free_.push_back(p); }
+
+        // Packets ever allocated, in use or not.
+        size_t Capacity() const { return chunks_.size() * CHUNK; }
+
+    private:
+        static constexpr size_t CHUNK = 64;
+
+        std::vector<std::unique_ptr<Packet[]>> chunks_;
+        std::vector<Packet*> free_;
+    };
+
+    // uTP (BEP 29): reliable streams over one UDP socket, with LEDBAT
+    // congestion control and selective ACKs. A thread owns the socket and
+    // every connection. Each connection is bridged to one end of a Unix
+    // socketpair whose other end is handed to the caller, so the peer
+    // protocol code, blocking or on an IoLoop, uses it like a TCP socket.
+    // Outgoing datagrams can be delayed or dropped to test over loopback.
+    class UtpEngine {
+    public:
+        struct Impairment {
+            std::chrono::microseconds delay{0};
+            // Fraction of outgoing datagrams dropped.
+            double loss = 0;
+        };
+
+        struct Stats {
+            std::atomic<size_t> sent{0};
+            std::atomic<size_t> resent{0};
+            std::atomic<size_t> dropped{0};
+            std::atomic<size_t> received{0};
+            // Send window, in bytes, of the connection adjusted last.
+            std::atomic<size_t> window{0};
+        };
+
+        static constexpr size_t HEADER_SIZE = 20;
+        static constexpr size_t MAX_DATAGRAM = 1400;
+        static constexpr size_t PAYLOAD = MAX_DATAGRAM - HEADER_SIZE;
+
+        // Binds `local` (port 0 picks one). Only an engine with `accept`
+        // answers SYNs.
+        UtpEngine(const SocketAddress& local, bool accept) : UtpEngine(local, accept, Impairment()) {}
+
+        UtpEngine(const SocketAddress& local, bool accept, Impairment impairment)
+            : accept_(accept), impairment_(impairment), rng_(std::random_device{}()) {
+            family_ = local.storage.ss_family;
+            udp_ = socket(family_, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int off = 0;
+            if (family_ == AF_INET6) setsockopt(udp_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            int buffer = 4 << 20;
+            setsockopt(udp_, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+            setsockopt(udp_, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+            wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (udp_ < 0 || wake_ < 0 || bind(udp_, local.Get(), local.length) < 0) {
+                if (udp_ >= 0) close(udp_);
+                if (wake_ >= 0) close(wake_);
+                throw std::runtime_error("Cannot bind uTP socket");
+            }
+            thread_ = std::thread([this] { Run(); });
+        }
+
+        ~UtpEngine() {
+            Stop();
+            for (auto& [key, c] : conns_) Release(*c);
+            for (PacketPool::Packet* p : delayed_) pool_.Put(p);
+            for (const Pending& p : connects_) close(p.bridge);
+            for (int fd : accepted_) close(fd);
+            close(udp_);
+            close(wake_);
+        }
+
+        UtpEngine(const UtpEngine&) = delete;
+        UtpEngine& operator=(const UtpEngine&) = delete;
+
+        // The engine outgoing peer connections use: dual-stack on an
+        // ephemeral port where IPv6 exists.
+        static UtpEngine& Shared() {
+            static UtpEngine engine = [] {
+                try {
+                    return UtpEngine(*Network::ParseAddress("::", 0), false);
+                } catch (const std::exception&) {
+                    return UtpEngine(*Network::ParseAddress("0.0.0.0", 0), false);
+                }
+            }();
+            return engine;
+        }
+
+        uint16_t Port() const {
+            sockaddr_storage addr{};
+            socklen_t len = sizeof(addr);
+            getsockname(udp_, reinterpret_cast<sockaddr*>(&addr), &len);
+            return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+        }
+
+        // Starts a connect and returns a non-blocking stream socket for it at
+        // once. When the peer answers the SYN the engine writes one byte to
+        // the socket, so it turns readable; Established() consumes that byte.
+        // Without `notify` no byte is written, and anything sent before then
+        // waits in the socket. A connect still unanswered after `timeout` is
+        // dropped, and the socket reads end-of-file.
+        int Connect(const SocketAddress& to, std::chrono::milliseconds timeout, bool notify = true) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) return -1;
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+            {
+                std::lock_guard lock(mutex_);
+                connects_.push_back({fds[1], to, Clock::now() + timeout, notify});
+            }
+            Wake();
+            return fds[0];
+        }
+
+        // Applies to datagrams sent from now on.
+        void Impair(Impairment impairment) {
+            {
+                std::lock_guard lock(mutex_);
+                next_impairment_ = impairment;
+            }
+            Wake();
+        }
+
+        // Reads the byte Connect() announces success with, once its socket
+        // is readable. False means the connect failed.
+        static bool Established(int sock) {
+            char status;
+            ssize_t n;
+            do {
+                n = recv(sock, &status, 1, 0);
+            } while (n < 0 && errno == EINTR);
+            return n == 1;
+        }
+
+        // Blocks until a peer connects and returns a blocking stream socket
+        // for it, or -1 once the engine is stopped.
+        int Accept() {
+            std::unique_lock lock(mutex_);
+            accepted_cv_.wait(lock, [this] { return stop_ || !accepted_.empty(); });
+            if (accepted_.empty()) return -1;
+            int fd = accepted_.front();
+            accepted_.pop_front();
+            return fd;
+        }
+
+        void Stop() {
+            {
+                std::lock_guard lock(mutex_);
+                stop_ = true;
+            }
+            accepted_cv_.notify_all();
+            Wake();
+            if (thread_.joinable()) thread_.join();
+        }
+
+        Stats stats;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+        using Packet = PacketPool::Packet;
+
+        enum Type : uint8_t { ST_DATA = 0, ST_FIN = 1, ST_STATE = 2, ST_RESET = 3, ST_SYN = 4 };
+
+        static constexpr uint32_t TARGET_DELAY_US = 100000;
+        static constexpr double MAX_GAIN = 3000;
+        static constexpr double MIN_WINDOW = 2 * PAYLOAD;
+        static constexpr double MAX_WINDOW = 1 << 20;
+        static constexpr uint32_t RECV_WINDOW = 1 << 20;
+        static constexpr int16_t REORDER_LIMIT = 1024;
+
+        struct Pending {
+            int bridge;
+            SocketAddress to;
+            Clock::time_point deadline;
+            bool notify;
+        };
+
+        struct Conn {
+            std::string key;
+            SocketAddress peer;
+            int bridge = -1;
+            uint16_t recv_id = 0;
+            uint16_t send_id = 0;
+            uint16_t seq_nr = 1;
+            uint16_t ack_nr = 0;
+            bool connected = false;
+            // Until connected: when to give up, and whether to announce it.
+            Clock::time_point connect_deadline;
+            bool notify = false;
+
+            // Sent but not cumulatively acknowledged, oldest first.
+            std::deque<Packet*> outstanding;
+            size_t in_flight = 0;
+            double max_window = 4 * PAYLOAD;
+            double ssthresh = MAX_WINDOW;
+            bool slow_start = true;
+            uint32_t peer_window = RECV_WINDOW;
+            Clock::time_point last_decay;
+
+            std::chrono::microseconds rtt{0};
+            std::chrono::microseconds rtt_var{0};
+            std::chrono::microseconds rto{1000000};
+            Clock::time_point rto_deadline;
+            int timeouts = 0;
+
+            // One-way delay of our packets as the peer measures it, and the
+            // minimum over the last one to two minutes as its base.
+            uint32_t reply_micro = 0;
+            uint32_t base_current = UINT32_MAX;
+            uint32_t base_previous = UINT32_MAX;
+            Clock::time_point base_started = Clock::now();
+
+            std::unordered_map<uint16_t, Packet*> reorder;
+            size_t reorder_bytes = 0;
+            std::string deliver;
+            bool ack_needed = false;
+
+            bool local_done = false;
+            bool bridge_broken = false;
+            std::optional<uint16_t> fin_seq;
+            bool remote_done = false;
+            bool bridge_shut = false;
+        };
+
+        static uint32_t NowMicros() {
+            return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count());
+        }
+
+        // Maps IPv4 peers into the v4-mapped range when the socket is IPv6.
+        SocketAddress Native(const SocketAddress& a) const {
+            if (family_ != AF_INET6 || a.storage.ss_family != AF_INET) return a;
+            const auto* v4 = reinterpret_cast<const sockaddr_in*>(&a.storage);
+            SocketAddress out;
+            auto* v6 = reinterpret_cast<sockaddr_in6*>(&out.storage);
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = v4->sin_port;
+            v6->sin6_addr.s6_addr[10] = v6->sin6_addr.s6_addr[11] = 0xff;
+            std::memcpy(&v6->sin6_addr.s6_addr[12], &v4->sin_addr, 4);
+            out.length = sizeof(sockaddr_in6);
+            return out;
+        }
+
+        static std::string Key(const SocketAddress& a, uint16_t id) {
+            std::string key(reinterpret_cast<const char*>(&a.storage), a.length);
+            key.append(reinterpret_cast<const char*>(&id), 2);
+            return key;
+        }
+
+        void Wake() {
+            uint64_t one = 1;
+            if (write(wake_, &one, sizeof(one)) < 0) {}
+        }
+
+        uint32_t RecvWindow(const Conn& c) const {
+            size_t used = c.deliver.size() + c.reorder_bytes;
+            return used >= RECV_WINDOW ? 0 : static_cast<uint32_t>(RECV_WINDOW - used);
+        }
+
+        size_t Window(const Conn& c) const {
+            return std::min<size_t>(static_cast<size_t>(c.max_window), c.peer_window);
+        }
+
+        // Refreshes the fields that change on every transmission.
+        void Stamp(Conn& c, uint8_t* header) {
+            Utils::Put32(header + 4, NowMicros());
+            Utils::Put32(header + 8, c.reply_micro);
+            Utils::Put32(header + 12, RecvWindow(c));
+            Utils::Put16(header + 18, c.ack_nr);
+            c.ack_needed = false;
+        }
+
+        size_t WriteHeader(Conn& c, uint8_t* out, Type type, uint16_t id, uint16_t seq) {
+            out[0] = static_cast<uint8_t>(type << 4 | 1);
+            out[1] = 0;
+            Utils::Put16(out + 2, id);
+            Utils::Put16(out + 16, seq);
+            Stamp(c, out);
+            return HEADER_SIZE;
+        }
+
+        void Emit(const SocketAddress& to, const uint8_t* data, size_t len) {
+            stats.sent++;
+            if (impairment_.loss > 0 && std::uniform_real_distribution<>(0, 1)(rng_) < impairment_.loss) {
+                stats.dropped++;
+                return;
+            }
+            if (impairment_.delay.count() > 0) {
+                Packet* d = pool_.Get();
+                std::memcpy(d->data, data, len);
+                d->len = len;
+                d->to = to;
+                d->time = Clock::now() + impairment_.delay;
+                delayed_.push_back(d);
+                return;
+            }
+            sendto(udp_, data, len, MSG_NOSIGNAL, to.Get(), to.length);
+        }
+
+        void Transmit(Conn& c, Packet* p) {
+            Stamp(c, p->data);
+            p->time = Clock::now();
+            Emit(c.peer, p->data, p->len);
+        }
+
+        // Queues a DATA, FIN or SYN packet for delivery until it is acked.
+        void SendReliable(Conn& c, Type type, const char* payload, size_t n) {
+            Packet* p = pool_.Get();
+            uint16_t id = type == ST_SYN ? c.recv_id : c.send_id;
+            p->seq = c.seq_nr++;
+            p->len = WriteHeader(c, p->data, type, id, p->seq);
+            std::memcpy(p->data + p->len, payload, n);
+            p->len += n;
+            p->payload = n;
+            p->transmissions = 1;
+            bool idle = c.outstanding.empty();
+            c.outstanding.push_back(p);
+            c.in_flight += n;
+            if (idle) c.rto_deadline = Clock::now() + c.rto;
+            Transmit(c, p);
+        }
+
+        // A bare ACK, with a selective ACK of what arrived past a gap.
+        void SendState(Conn& c) {
+            uint8_t out[HEADER_SIZE + 6];
+            size_t len = WriteHeader(c, out, ST_STATE, c.send_id, c.seq_nr);
+            if (!c.reorder.empty()) {
+                out[1] = 1;
+                out[len] = 0;
+                out[len + 1] = 4;
+                uint8_t* mask = out + len + 2;
+                std::memset(mask, 0, 4);
+                for (int i = 0; i < 32; i++) {
+                    if (c.reorder.count(static_cast<uint16_t>(c.ack_nr + 2 + i))) mask[i >> 3] |= 1 << (i & 7);
+                }
+                len += 6;
+            }
+            Emit(c.peer, out, len);
+        }
+
+        // Sends packets marked lost, oldest first, as far as the window allows.
+        void Resend(Conn& c) {
+            for (Packet* p : c.outstanding) {
+                if (!p->resend) continue;
+                if (c.in_flight > 0 && c.in_flight + p->payload > Window(c)) break;
+                p->resend = false;
+                p->transmissions++;
+                c.in_flight += p->payload;
+                stats.resent++;
+                Transmit(c, p);
+            }
+        }
+
+        void UpdateWindow(Conn& c, size_t acked, uint32_t delay_sample) {
+            if (acked == 0 || delay_sample == 0) return;
+            auto now = Clock::now();
+            if (now - c.base_started > std::chrono::minutes(1)) {
+                c.base_previous = c.base_current;
+                c.base_current = delay_sample;
+                c.base_started = now;
+            } else {
+                c.base_current = std::min(c.base_current, delay_sample);
+            }
+            uint32_t base = std::min(c.base_current, c.base_previous);
+            double our_delay = static_cast<double>(delay_sample - base);
+            double off_target = (TARGET_DELAY_US - our_delay) / TARGET_DELAY_US;
+            double ledbat = c.max_window + MAX_GAIN * off_target * acked / c.max_window;
+            if (c.slow_start) {
+                double doubled = c.max_window + acked;
+                if (our_delay > TARGET_DELAY_US * 0.9 || doubled > c.ssthresh) {
+                    c.slow_start = false;
+                    c.ssthresh = c.max_window;
+                } else {
+                    ledbat = std::max(ledbat, doubled);
+                }
+            }
+            c.max_window = std::clamp(ledbat, MIN_WINDOW, MAX_WINDOW);
+            stats.window = static_cast<size_t>(c.max_window);
+        }
+
+        void OnLoss(Conn& c) {
+            auto now = Clock::now();
+            if (now - c.last_decay < std::max(c.rtt, std::chrono::microseconds(1000))) return;
+            c.last_decay = now;
+            c.slow_start = false;
+            c.max_window = std::max(MIN_WINDOW, c.max_window / 2);
+            c.ssthresh = c.max_window;
+            stats.window = static_cast<size_t>(c.max_window);
+        }
+
+        void ProcessAck(Conn& c, uint16_t ack, std::string_view sack, uint32_t delay_sample) {
+            auto now = Clock::now();
+            size_t acked = 0;
+            while (!c.outstanding.empty() && static_cast<int16_t>(ack - c.outstanding.front()->seq) >= 0) {
+                Packet* p = c.outstanding.front();
+                c.outstanding.pop_front();
+                if (!p->sacked) {
+                    if (!p->resend) c.in_flight -= p->payload;
+                    acked += p->payload;
+                    if (p->transmissions == 1) {
+                        auto sample = std::chrono::duration_cast<std::chrono::microseconds>(now - p->time);
+                        if (c.rtt.count() == 0) {
+                            c.rtt = sample;
+                            c.rtt_var = sample / 2;
+                        } else {
+                            auto delta = c.rtt - sample;
+                            c.rtt_var += (std::chrono::abs(delta) - c.rtt_var) / 4;
+                            c.rtt += (sample - c.rtt) / 8;
+                        }
+                        c.rto = std::max<std::chrono::microseconds>(c.rtt + 4 * c.rtt_var, std::chrono::milliseconds(500));
+                    }
+                }
+                pool_.Put(p);
+                c.timeouts = 0;
+                c.rto_deadline = now + c.rto;
+            }
+
+            for (size_t i = 0; i < sack.size() * 8; i++) {
+                if (!(sack[i >> 3] & (1 << (i & 7)))) continue;
+                uint16_t seq = static_cast<uint16_t>(ack + 2 + i);
+                for (Packet* p : c.outstanding) {
+                    if (p->seq != seq || p->sacked) continue;
+                    p->sacked = true;
+                    if (!p->resend) c.in_flight -= p->payload;
+                    p->resend = false;
+                    acked += p->payload;
+                }
+            }
+
+            // Fast retransmit: a packet with three selectively acked packets
+            // after it is taken as lost and sent again at once, whatever the
+            // window, since packets past the SACK range may never be acked
+            // until it arrives.
+            int sacked_after = 0;
+            for (auto it = c.outstanding.rbegin(); it != c.outstanding.rend(); ++it) {
+                Packet* p = *it;
+                if (p->sacked) {
+                    sacked_after++;
+                } else if (sacked_after >= 3 && !p->resend && p->transmissions == 1) {
+                    OnLoss(c);
+                    p->transmissions++;
+                    stats.resent++;
+                    Transmit(c, p);
+                }
+            }
+            UpdateWindow(c, acked, delay_sample);
+            Resend(c);
+        }
+
+        // A DATA or FIN packet; the payload is queued for the bridge in order.
+        void ProcessData(Conn& c, Type type, uint16_t seq, std::string_view payload) {
+            c.ack_needed = true;
+            if (type == ST_FIN) c.fin_seq = seq;
+            int16_t ahead = static_cast<int16_t>(seq - static_cast<uint16_t>(c.ack_nr + 1));
+            if (ahead < 0) return;
+            if (ahead > 0) {
+                if (ahead < REORDER_LIMIT && !c.reorder.count(seq) && payload.size() <= PacketPool::PACKET_SIZE) {
+                    Packet* p = pool_.Get();
+                    std::memcpy(p->data, payload.data(), payload.size());
+                    p->len = payload.size();
+                    c.reorder[seq] = p;
+                    c.reorder_bytes += p->len;
+                }
+                return;
+            }
+            c.deliver.append(payload);
+            c.ack_nr = seq;
+            while (true) {
+                auto it = c.reorder.find(static_cast<uint16_t>(c.ack_nr + 1));
+                if (it == c.reorder.end()) break;
+                c.deliver.append(reinterpret_cast<const char*>(it->second->data), it->second->len);
+                c.reorder_bytes -= it->second->len;
+                pool_.Put(it->second);
+                c.reorder.erase(it);
+                c.ack_nr++;
+            }
+            if (c.fin_seq && c.ack_nr == *c.fin_seq) c.remote_done = true;
+        }
+
+        void Receive() {
+            uint8_t buf[PacketPool::PACKET_SIZE];
+            while (true) {
+                SocketAddress from;
+                from.length = sizeof(from.storage);
+                ssize_t n = recvfrom(udp_, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from.storage), &from.length);
+                if (n < 0) return;
+                if (n < static_cast<ssize_t>(HEADER_SIZE) || (buf[0] & 0x0f) != 1) continue;
+                stats.received++;
+                Type type = static_cast<Type>(buf[0] >> 4);
+                uint16_t id = Utils::Get16(buf + 2);
+                uint16_t seq = Utils::Get16(buf + 16);
+                uint16_t ack = Utils::Get16(buf + 18);
+
+                std::string_view sack;
+                size_t pos = HEADER_SIZE;
+                uint8_t ext = buf[1];
+                bool valid = true;
+                while (ext != 0) {
+                    if (pos + 2 > static_cast<size_t>(n) || pos + 2 + buf[pos + 1] > static_cast<size_t>(n)) {
+                        valid = false;
+                        break;
+                    }
+                    if (ext == 1) sack = std::string_view(reinterpret_cast<const char*>(buf + pos + 2), buf[pos + 1]);
+                    ext = buf[pos];
+                    pos += 2 + buf[pos + 1];
+                }
+                if (!valid) continue;
+                std::string_view payload(reinterpret_cast<const char*>(buf + pos), n - pos);
+
+                if (type == ST_SYN) {
+                    if (accept_) OnSyn(from, id, seq);
+                    continue;
+                }
+                auto it = conns_.find(Key(from, id));
+                if (it == conns_.end()) continue;
+                Conn& c = *it->second;
+                if (type == ST_RESET) {
+                    Release(c);
+                    conns_.erase(it);
+                    continue;
+                }
+                c.reply_micro = NowMicros() - Utils::Get32(buf + 4);
+                c.peer_window = Utils::Get32(buf + 12);
+                if (!c.connected) {
+                    if (type != ST_STATE) continue;
+                    c.connected = true;
+                    c.ack_nr = static_cast<uint16_t>(seq - 1);
+                    if (c.notify) c.deliver.push_back('\0');
+                }
+                ProcessAck(c, ack, sack, Utils::Get32(buf + 8));
+                if (type == ST_DATA || type == ST_FIN) ProcessData(c, type, seq, payload);
+            }
+        }
+
+        void OnSyn(const SocketAddress& from, uint16_t id, uint16_t seq) {
+            std::string key = Key(from, static_cast<uint16_t>(id + 1));
+            auto it = conns_.find(key);
+            if (it != conns_.end()) {
+                SendState(*it->second);
+                return;
+            }
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) return;
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+            auto c = std::make_unique<Conn>();
+            c->key = key;
+            c->peer = from;
+            c->bridge = fds[1];
+            c->recv_id = static_cast<uint16_t>(id + 1);
+            c->send_id = id;
+            c->seq_nr = static_cast<uint16_t>(rng_());
+            c->ack_nr = seq;
+            c->connected = true;
+            SendState(*c);
+            conns_[key] = std::move(c);
+            {
+                std::lock_guard lock(mutex_);
+                accepted_.push_back(fds[0]);
+            }
+            accepted_cv_.notify_one();
+        }
+
+        void StartConnect(const Pending& p) {
+            auto c = std::make_unique<Conn>();
+            c->peer = Native(p.to);
+            c->bridge = p.bridge;
+            c->connect_deadline = p.deadline;
+            c->notify = p.notify;
+            do {
+                c->recv_id = static_cast<uint16_t>(rng_());
+                c->key = Key(c->peer, c->recv_id);
+            } while (conns_.count(c->key));
+            c->send_id = static_cast<uint16_t>(c->recv_id + 1);
+            SendReliable(*c, ST_SYN, nullptr, 0);
+            conns_[c->key] = std::move(c);
+        }
+
+        // Reads what the application wrote and sends it, while the window
+        // has room.
+        void ReadBridge(Conn& c) {
+            char buf[PAYLOAD];
+            while (!c.local_done && (c.in_flight == 0 || c.in_flight + PAYLOAD <= Window(c))) {
+                ssize_t n = recv(c.bridge, buf, sizeof(buf), 0);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                    if (errno == EINTR) continue;
+                    n = 0;
+                }
+                if (n == 0) {
+                    c.local_done = true;
+                    SendReliable(c, ST_FIN, nullptr, 0);
+                    return;
+                }
+                SendReliable(c, ST_DATA, buf, n);
+            }
+        }
+
+        void WriteBridge(Conn& c) {
+            size_t before = RecvWindow(c);
+            while (!c.deliver.empty() && !c.bridge_broken) {
+                ssize_t n = send(c.bridge, c.deliver.data(), c.deliver.size(), MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    if (errno == EINTR) continue;
+                    c.bridge_broken = true;
+                    break;
+                }
+                c.deliver.erase(0, n);
+            }
+            if (c.bridge_broken) c.deliver.clear();
+            // Tell a sender that was stalled on our window that it reopened.
+            if (before < PAYLOAD && RecvWindow(c) >= PAYLOAD) c.ack_needed = true;
+        }
+
+        void Release(Conn& c) {
+            for (Packet* p : c.outstanding) pool_.Put(p);
+            for (auto& [seq, p] : c.reorder) pool_.Put(p);
+            c.outstanding.clear();
+            c.reorder.clear();
+            close(c.bridge);
+        }
+
+        void CheckTimeouts(Clock::time_point now) {
+            std::vector<std::string> dead;
+            for (auto& [key, cp] : conns_) {
+                Conn& c = *cp;
+                if (!c.connected && now >= c.connect_deadline) {
+                    dead.push_back(key);
+                    continue;
+                }
+                if (c.outstanding.empty() || now < c.rto_deadline) continue;
+                if (++c.timeouts > (c.connected ? 8 : 3)) {
+                    dead.push_back(key);
+                    continue;
+                }
+                c.rto = std::min<std::chrono::microseconds>(c.rto * 2, std::chrono::seconds(8));
+                c.max_window = PAYLOAD;
+                c.slow_start = false;
+                stats.window = PAYLOAD;
+                for (Packet* p : c.outstanding) {
+                    if (p->sacked || p->resend) continue;
+                    p->resend = true;
+                    c.in_flight -= p->payload;
+                }
+                c.rto_deadline = now + c.rto;
+                Resend(c);
+            }
+            for (const std::string& key : dead) {
+                Release(*conns_[key]);
+                conns_.erase(key);
+            }
+        }
+
+        void Run() {
+            std::vector<pollfd> fds;
+            // Keys, not pointers: Receive() may free a connection that was
+            // polled.
+            std::vector<std::string> polled;
+            while (true) {
+                std::vector<Pending> connects;
+                {
+                    std::lock_guard lock(mutex_);
+                    if (stop_) return;
+                    connects.swap(connects_);
+                    if (next_impairment_) impairment_ = *std::exchange(next_impairment_, std::nullopt);
+                }
+                for (const Pending& p : connects) StartConnect(p);
+
+                auto now = Clock::now();
+                auto wake = now + std::chrono::seconds(1);
+                if (!delayed_.empty()) wake = std::min(wake, delayed_.front()->time);
+                fds.assign({{udp_, POLLIN, 0}, {wake_, POLLIN, 0}});
+                polled.clear();
+                for (auto& [key, cp] : conns_) {
+                    Conn& c = *cp;
+                    if (!c.outstanding.empty()) wake = std::min(wake, c.rto_deadline);
+                    if (!c.connected) wake = std::min(wake, c.connect_deadline);
+                    short events = 0;
+                    if (c.connected && !c.local_done && (c.in_flight == 0 || c.in_flight + PAYLOAD <= Window(c))) events |= POLLIN;
+                    if (!c.deliver.empty() && !c.bridge_broken) events |= POLLOUT;
+                    // poll reports a hangup even for no events, so an idle
+                    // bridge is left out.
+                    fds.push_back({events ? c.bridge : -1, events, 0});
+                    polled.push_back(key);
+                }
+                auto timeout = std::chrono::ceil<std::chrono::milliseconds>(wake - now).count();
+                if (poll(fds.data(), fds.size(), static_cast<int>(std::max<long long>(timeout, 0))) < 0 && errno != EINTR) return;
+
+                if (fds[1].revents) {
+                    uint64_t count;
+                    if (read(wake_, &count, sizeof(count)) < 0) {}
+                }
+                if (fds[0].revents) Receive();
+                for (size_t i = 0; i < polled.size(); i++) {
+                    if (!(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                    auto it = conns_.find(polled[i]);
+                    if (it != conns_.end() && it->second->bridge == fds[i + 2].fd) ReadBridge(*it->second);
+                }
+
+                now = Clock::now();
+                while (!delayed_.empty() && delayed_.front()->time <= now) {
+                    Packet* d = delayed_.front();
+                    delayed_.pop_front();
+                    sendto(udp_, d->data, d->len, MSG_NOSIGNAL, d->to.Get(), d->to.length);
+                    pool_.Put(d);
+                }
+                CheckTimeouts(now);
+
+                std::vector<std::string> finished;
+                for (auto& [key, cp] : conns_) {
+                    Conn& c = *cp;
+                    WriteBridge(c);
+                    if (c.connected && c.ack_needed) SendState(c);
+                    if (c.remote_done && c.deliver.empty() && !c.bridge_shut) {
+                        shutdown(c.bridge, SHUT_WR);
+                        c.bridge_shut = true;
+                    }
+                    if (c.local_done && c.outstanding.empty() && (c.remote_done || c.bridge_broken) && c.deliver.empty()) finished.push_back(key);
+                }
+                for (const std::string& key : finished) {
+                    Release(*conns_[key]);
+                    conns_.erase(key);
+                }
+            }
+        }
+
+        int family_;
+        int udp_ = -1;
+        int wake_ = -1;
+        bool accept_;
+        Impairment impairment_;
+        std::mt19937 rng_;
+        PacketPool pool_;
+        std::unordered_map<std::string, std::unique_ptr<Conn>> conns_;
+        std::deque<Packet*> delayed_;
+
+        std::mutex mutex_;
+        std::condition_variable accepted_cv_;
+        std::vector<Pending> connects_;
+        std::optional<Impairment> next_impairment_;
+        std::deque<int> accepted_;
+        bool stop_ = false;
+        std::thread thread_;
+    };
+
+    // Connects to many addresses at once and hands back sockets in the order
+    // their connects complete, so one dead peer costs at most
+    // `attempt_timeout` and never delays a live one. At most `parallel`
+    // attempts are open at a time; the rest start as earlier ones finish.
+    // Addresses are tried IPv6 and IPv4 alternately, as RFC 8305 orders
+    // them, and with a nonzero `stagger` each attempt starts that long after
+    // the one before unless every earlier attempt has already failed.
+    class Connector {
+    public:
+        struct Options {
+            std::chrono::milliseconds attempt_timeout{3000};
+            std::chrono::milliseconds overall_timeout{15000};
+            size_t parallel = 32;
+            std::chrono::milliseconds stagger{0};
+            // Whether returned sockets get Network::SetBlocking or stay
+            // non-blocking for an IoLoop.
+            bool blocking = true;
+            Transport transport = Network::peer_transport;
+        };
+
+        // RFC 8305's recommended Connection Attempt Delay.
+        static constexpr std::chrono::milliseconds ATTEMPT_DELAY{250};
+
+        Connector(const std::vector<PeerAddress>& peers, Options options) : Connector(Parse(peers), options) {}
+
+        Connector(std::vector<SocketAddress> addresses, Options options)
+            : addresses_(Interleave(std::move(addresses))), options_(options),
+              deadline_(std::chrono::steady_clock::now() + options.overall_timeout) {}
+
+        ~Connector() {
+            for (const Attempt& a : attempts_) close(a.fd);
+        }
+
+        Connector(const Connector&) = delete;
+        Connector& operator=(const Connector&) = delete;
+
+        // Races every address `hostname` resolves to, happy-eyeballs style,
+        // and returns the first socket to connect, or -1.
+        static int ConnectHostname(const std::string& hostname, const std::string& port, bool blocking = true) {
+            Options options;
+            options.attempt_timeout = options.overall_timeout = std::chrono::seconds(10);
+            options.stagger = ATTEMPT_DELAY;
+            options.blocking = blocking;
+            options.transport = Transport::Tcp;
+            Connector connector(Resolver::Shared().Resolve(hostname, port).get(), options);
+            return connector.Next();
+        }
+
+        // Blocks until the next connect succeeds and returns its socket;
+        // `which` receives its address. Returns -1 once every attempt has
+        // failed or the overall deadline has passed.
+        int Next(SocketAddress* which = nullptr) {
+            while (true) {
+                auto now = std::chrono::steady_clock::now();
+                while (attempts_.size() < options_.parallel && next_ < addresses_.size() &&
+                       (attempts_.empty() || now >= next_start_)) {
+                    const SocketAddress& a = addresses_[next_++];
+                    int fd = Utp() ? UtpEngine::Shared().Connect(a, options_.attempt_timeout) : Network::ConnectNonBlocking(a.Get(), a.length);
+                    next_start_ = now + options_.stagger;
+                    if (fd >= 0) attempts_.push_back({fd, a, now + options_.attempt_timeout});
+                }
+                if (attempts_.empty() || now >= deadline_) return -1;
+
+                auto wake = deadline_;
+                if (attempts_.size() < options_.parallel && next_ < addresses_.size()) wake = std::min(wake, next_start_);
+                std::vector<pollfd> fds;
+                for (const Attempt& a : attempts_) {
+                    fds.push_back({a.fd, static_cast<short>(Utp() ? POLLIN : POLLOUT), 0});
+                    wake = std::min(wake, a.deadline);
+                }
+                int timeout = static_cast<int>(std::max<long long>(std::chrono::ceil<std::chrono::milliseconds>(wake - now).count(), 0));
+                if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) return -1;
+
+                now = std::chrono::steady_clock::now();
+                int ready = -1;
+                std::vector<Attempt> pending;
+                for (size_t i = 0; i < attempts_.size(); i++) {
+                    Attempt& a = attempts_[i];
+                    if (fds[i].revents != 0 && ready < 0) {
+                        int err = 0;
+                        socklen_t len = sizeof(err);
+                        if (Utp() ? UtpEngine::Established(a.fd) : getsockopt(a.fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                            ready = a.fd;
+                            if (which) *which = a.address;
+                            continue;
+                        }
+                        close(a.fd);
+                    } else if (fds[i].revents != 0 || now < a.deadline) {
+                        pending.push_back(a);
+                    } else {
+                        close(a.fd);
+                    }
+                }
+                attempts_ = std::move(pending);
+                if (ready >= 0) {
+                    if (options_.blocking) Network::SetBlocking(ready);
+                    return ready;
+                }
+            }
+        }
+
+    private:
+        struct Attempt {
+            int fd;
+            SocketAddress address;
+            std::chrono::steady_clock::time_point deadline;
+        };
+
+        bool Utp() const { return options_.transport == Transport::Utp; }
+
+        static std::vector<SocketAddress> Parse(const std::vector<PeerAddress>& peers) {
+            std::vector<SocketAddress> out;
+            for (const PeerAddress& p : peers) {
+                if (std::optional<SocketAddress> a = Network::ParseAddress(p.ip, p.port)) out.push_back(*a);
+            }
+            return out;
+        }
+
+        // IPv6 first, then alternating families, keeping each family's order.
+        static std::vector<SocketAddress> Interleave(std::vector<SocketAddress> addresses) {
+            std::vector<SocketAddress> v6, v4, out;
+            for (const SocketAddress& a : addresses) (a.storage.ss_family == AF_INET6 ? v6 : v4).push_back(a);
+            for (size_t i = 0; i < std::max(v6.size(), v4.size()); i++) {
+                if (i < v6.size()) out.push_back(v6[i]);
+                if (i < v4.size()) out.push_back(v4[i]);
+            }
+            return out;
+        }
+
+        std::vector<SocketAddress> addresses_;
+        Options options_;
+        std::chrono::steady_clock::time_point deadline_;
+        std::chrono::steady_clock::time_point next_start_{};
+        size_t next_ = 0;
+        std::vector<Attempt> attempts_;
+    };
+
+    class IoLoop;
+
+    // Protocol state machine whose socket I/O is done by an IoLoop. Bytes
+    // received arrive through OnData; bytes appended to `outbox` are sent by
+    // the loop as the socket accepts them.
+    class Connection {
+    public:
+        virtual ~Connection() = default;
+
+        // The non-blocking connect has completed.
+        virtual void OnConnected() {}
+        // Returns false to close the connection.
+        virtual bool OnData(std::string_view data) = 0;
+        // The connection failed or was closed by either side. It is destroyed
+        // right after this returns.
+        virtual void OnClosed() {}
+        // `wake_at` has passed; the loop clears it before the call. Returns
+        // false to close the connection.
+        virtual bool OnWake() { return true; }
+
+        std::string outbox;
+        // When set, the loop calls OnWake() at this time. A connection
+        // waiting for it is not closed as idle.
+        std::optional<std::chrono::steady_clock::time_point> wake_at;
+
+    protected:
+        IoLoop& Loop() { return *loop_; }
+
+    private:
+        friend class IoLoop;
+        IoLoop* loop_ = nullptr;
+    };
+
+    // Owns a set of connections and drives them from a single thread.
+    class IoLoop {
+    public:
+        virtual ~IoLoop() = default;
+
+        // Takes ownership of `fd`, a socket with a non-blocking connect in
+        // progress. May be called from inside a connection's callback.
+        virtual void Add(int fd, std::unique_ptr<Connection> conn) = 0;
+        // Runs until Stop() is called or no connections remain.
+        virtual void Run() = 0;
+
+        void Stop() { stopped_ = true; }
+
+        // Writes `data` to `fd` at `offset`. This default is a plain pwrite();
+        // a loop may instead queue the write, finishing it before Run()
+        // returns.
+        virtual void WriteFile(int fd, std::vector<uint8_t> data, off_t offset) {
+            if (pwrite(fd, data.data(), data.size(), offset) != static_cast<ssize_t>(data.size())) write_failed_ = true;
+        }
+
+        bool WriteFailed() const { return write_failed_; }
+
+    protected:
+        static void Attach(Connection& conn, IoLoop* loop) { conn.loop_ = loop; }
+
+        bool stopped_ = false;
+        bool write_failed_ = false;
+    };
+
+    // Readiness-driven IoLoop on epoll. Sockets are level-triggered; write
+    // interest is only registered while a connection is connecting or has
+    // unsent bytes. A connection idle for IDLE_TIMEOUT is closed.
+    class Reactor : public IoLoop {
+    public:
+        static constexpr std::chrono::seconds IDLE_TIMEOUT{10};
+
+        Reactor() {
+            epfd_ = epoll_create1(EPOLL_CLOEXEC);
+            if (epfd_ < 0) throw std::runtime_error("epoll_create1 failed");
+        }
+
+        ~Reactor() override {
+            for (auto& [fd, entry] : entries_) close(fd);
+            close(epfd_);
+        }
+
+        Reactor(const Reactor&) = delete;
+        Reactor& operator=(const Reactor&) = delete;
+
+        void Add(int fd, std::unique_ptr<Connection> conn) override {
+            Attach(*conn, this);
+            Entry& e = entries_[fd];
+            e.conn = std::move(conn);
+            e.events = EPOLLOUT;
+            e.last_active = std::chrono::steady_clock::now();
+            epoll_event ev{};
+            ev.events = e.events;
+            ev.data.fd = fd;
+            if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                entries_.erase(fd);
+                close(fd);
+            }
+        }
+
+        void Run() override {
+            std::vector<epoll_event> events(256);
+            std::vector<char> buf(64 * 1024);
+            while (!stopped_ && !entries_.empty()) {
+                auto wake = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                for (auto& [fd, e] : entries_) {
+                    if (e.conn->wake_at) wake = std::min(wake, *e.conn->wake_at);
+                }
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - std::chrono::steady_clock::now());
+                int n = epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), static_cast<int>(std::max<long long>(wait.count(), 0)));
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    throw std::runtime_error("epoll_wait failed");
+                }
+                auto now = std::chrono::steady_clock::now();
+                for (int i = 0; i < n && !stopped_; i++) {
+                    int fd = events[i].data.fd;
+                    auto it = entries_.find(fd);
+                    if (it == entries_.end()) continue;
+                    Entry& e = it->second;
+                    e.last_active = now;
+                    if (Dispatch(fd, e, events[i].events, buf)) Rearm(fd, e);
+                    else Close(fd);
+                }
+                std::vector<int> due, idle;
+                for (auto& [fd, e] : entries_) {
+                    if (e.conn->wake_at) {
+                        if (*e.conn->wake_at <= now) due.push_back(fd);
+                    } else if (now - e.last_active > IDLE_TIMEOUT) {
+                        idle.push_back(fd);
+                    }
+                }
+                for (int fd : due) {
+                    auto it = entries_.find(fd);
+                    if (it == entries_.end() || stopped_) continue;
+                    Entry& e = it->second;
+                    e.conn->wake_at.reset();
+                    e.last_active = now;
+                    if (e.conn->OnWake() && Flush(fd, *e.conn)) Rearm(fd, e);
+                    else Close(fd);
+                }
+                for (int fd : idle) Close(fd);
+            }
+        }
+
+    private:
+        struct Entry {
+            std::unique_ptr<Connection> conn;
+            uint32_t events = 0;
+            bool connected = false;
+            std::chrono::steady_clock::time_point last_active;
+        };
+
+        bool Dispatch(int fd, Entry& e, uint32_t events, std::vector<char>& buf) {
+            if (!e.connected) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) return false;
+                if (!(events & EPOLLOUT)) return true;
+                e.connected = true;
+                e.conn->OnConnected();
+            } else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                while (true) {
+                    ssize_t r = recv(fd, buf.data(), buf.size(), 0);
+                    if (r == 0) return false;
+                    if (r < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        if (errno == EINTR) continue;
+                        return false;
+                    }
+                    if (!e.conn->OnData(std::string_view(buf.data(), r))) return false;
+                    if (static_cast<size_t>(r) < buf.size()) break;
+                }
+            }
+            return Flush(fd, *e.conn);
+        }
+
+        static bool Flush(int fd, Connection& conn) {
+            size_t sent = 0;
+            while (sent < conn.outbox.size()) {
+                ssize_t r = send(fd, conn.outbox.data() + sent, conn.outbox.size() - sent, MSG_NOSIGNAL);
+                if (r < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                sent += r;
+            }
+            conn.outbox.erase(0, sent);
+            return true;
+        }
+
+        void Rearm(int fd, Entry& e) {
+            uint32_t want = e.connected ? EPOLLIN : EPOLLOUT;
+            if (!e.conn->outbox.empty()) want |= EPOLLOUT;
+            if (want == e.events) return;
+            e.events = want;
+            epoll_event ev{};
+            ev.events = want;
+            ev.data.fd = fd;
+            epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev);
+        }
+
+        void Close(int fd) {
+            auto it = entries_.find(fd);
+            if (it == entries_.end()) return;
+            std::unique_ptr<Connection> conn = std::move(it->second.conn);
+            entries_.erase(it);
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            conn->OnClosed();
+        }
+
+        int epfd_ = -1;
+        std::unordered_map<int, Entry> entries_;
+    };
+
+    // Completion-driven IoLoop on io_uring, through the raw syscalls. Every
+    // receive, send, file write and connect wait of a loop iteration goes
+    // into one submission queue and is submitted together with the wait for
+    // completions, in a single io_uring_enter(). Receives land in buffers
+    // registered with the kernel once, up front; connections past the pool
+    // fall back to ordinary buffers.
+    class UringLoop : public IoLoop {
+    public:
+        static constexpr unsigned QUEUE_DEPTH = 512;
+        static constexpr size_t SLOT_SIZE = 64 * 1024;
+        static constexpr size_t SLOT_COUNT = 64;
+
+        // Whether the kernel lets this process create a ring at all.
+        static bool Available() {
+            io_uring_params params{};
+            int fd = static_cast<int>(syscall(__NR_io_uring_setup, 1, &params));
+            if (fd < 0) return false;
+            close(fd);
+            return true;
+        }
+
+        UringLoop() {
+            io_uring_params params{};
+            ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params));
+            if (ring_fd_ < 0) throw std::runtime_error("io_uring_setup failed");
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+                close(ring_fd_);
+                throw std::runtime_error("io_uring is too old");
+            }
+            ring_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                  params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+            if (ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+                if (ring_ != MAP_FAILED) munmap(ring_, ring_size_);
+                close(ring_fd_);
+                throw std::runtime_error("Cannot map io_uring");
+            }
+            char* base = static_cast<char*>(ring_);
+            sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+            sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+            sq_array_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+            sq_entries_ = params.sq_entries;
+            cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+            sqes_ = static_cast<io_uring_sqe*>(sqes);
+            tail_ = *sq_tail_;
+            // Without a wait timeout, wakes fall back to the 1-second tick.
+            ext_arg_ = params.features & IORING_FEAT_EXT_ARG;
+
+            // Registration counts against RLIMIT_MEMLOCK; without it every
+            // connection uses plain receives.
+            slots_.resize(SLOT_COUNT * SLOT_SIZE);
+            std::vector<iovec> iov(SLOT_COUNT);
+            for (size_t i = 0; i < SLOT_COUNT; i++) iov[i] = {slots_.data() + i * SLOT_SIZE, SLOT_SIZE};
+            if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iov.data(), SLOT_COUNT) == 0) {
+                for (size_t i = SLOT_COUNT; i > 0; i--) free_slots_.push_back(static_cast<int>(i - 1));
+            } else {
+                slots_.clear();
+            }
+        }
+
+        ~UringLoop() override {
+            for (auto& [id, e] : entries_) {
+                if (!e.closing) shutdown(e.fd, SHUT_RDWR);
+            }
+            if (timer_armed_) {
+                io_uring_sqe* sqe = Sqe(Op::Timer, 0);
+                sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+                sqe->addr = static_cast<uint8_t>(Op::Timer);
+            }
+            // The kernel may still be writing into our buffers; wait for every
+            // outstanding operation before unmapping anything. Connections
+            // are not called back: what they refer to may already be gone.
+            while (inflight_ > 0 && Enter(1)) Reap(false);
+            for (auto& [id, e] : entries_) close(e.fd);
+            munmap(sqes_, sqes_size_);
+            munmap(ring_, ring_size_);
+            close(ring_fd_);
+        }
+
+        UringLoop(const UringLoop&) = delete;
+        UringLoop& operator=(const UringLoop&) = delete;
+
+        void Add(int fd, std::unique_ptr<Connection> conn) override {
+            Attach(*conn, this);
+            uint64_t id = next_id_++;
+            Entry& e = entries_[id];
+            e.fd = fd;
+            e.conn = std::move(conn);
+            e.last_active = std::chrono::steady_clock::now();
+            if (!free_slots_.empty()) {
+                e.slot = free_slots_.back();
+                free_slots_.pop_back();
+            } else {
+                e.heap_buf.resize(SLOT_SIZE);
+            }
+            io_uring_sqe* sqe = Sqe(Op::Connect, id);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = POLLOUT;
+            e.inflight++;
+        }
+
+        void WriteFile(int fd, std::vector<uint8_t> data, off_t offset) override {
+            uint64_t id = next_id_++;
+            FileWrite& w = writes_[id];
+            w.fd = fd;
+            w.data = std::move(data);
+            w.offset = offset;
+            SubmitWrite(id, w);
+        }
+
+        void Run() override {
+            while ((!stopped_ && LiveConnections() > 0) || !writes_.empty()) {
+                if (!timer_armed_) {
+                    io_uring_sqe* sqe = Sqe(Op::Timer, 0);
+                    sqe->opcode = IORING_OP_TIMEOUT;
+                    sqe->addr = reinterpret_cast<uint64_t>(&tick_);
+                    sqe->len = 1;
+                    timer_armed_ = true;
+                }
+                std::optional<std::chrono::steady_clock::time_point> wake = NextWake();
+                if (wake && ext_arg_) {
+                    auto wait = std::max<std::chrono::nanoseconds>(*wake - std::chrono::steady_clock::now(), {});
+                    __kernel_timespec ts{wait.count() / 1000000000, wait.count() % 1000000000};
+                    if (!Enter(1, &ts)) throw std::runtime_error("io_uring_enter failed");
+                } else if (!Enter(1)) {
+                    throw std::runtime_error("io_uring_enter failed");
+                }
+                Reap(true);
+                Wake();
+            }
+        }
+
+    private:
+        enum class Op : uint8_t { Connect, Read, Send, Write, Timer };
+
+        struct Entry {
+            int fd = -1;
+            std::unique_ptr<Connection> conn;
+            int slot = -1;
+            std::vector<char> heap_buf;
+            std::string sending;
+            size_t sent = 0;
+            bool send_inflight = false;
+            bool connected = false;
+            bool closing = false;
+            int inflight = 0;
+            std::chrono::steady_clock::time_point last_active;
+        };
+
+        struct FileWrite {
+            int fd;
+            std::vector<uint8_t> data;
+            off_t offset;
+            size_t written = 0;
+        };
+
+        size_t LiveConnections() const { return entries_.size() - closing_; }
+
+        io_uring_sqe* Sqe(Op op, uint64_t id) {
+            if (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) Enter(0);
+            unsigned index = tail_ & sq_mask_;
+            io_uring_sqe* sqe = &sqes_[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->user_data = id << 8 | static_cast<uint8_t>(op);
+            sq_array_[index] = index;
+            tail_++;
+            inflight_++;
+            return sqe;
+        }
+
+        // Publishes queued submissions and waits for `wait` completions, or
+        // until `timeout` has passed.
+        bool Enter(unsigned wait, const __kernel_timespec* timeout = nullptr) {
+            unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+            unsigned to_submit = tail_ - head;
+            unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+            io_uring_getevents_arg arg{};
+            if (timeout) {
+                flags |= IORING_ENTER_EXT_ARG;
+                arg.ts = reinterpret_cast<uint64_t>(timeout);
+            }
+            while (true) {
+                long r = timeout ? syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait, flags, &arg, sizeof(arg))
+                                 : syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait, flags, nullptr, 0);
+                if (r >= 0 || errno == ETIME) return true;
+                if (errno == EINTR) continue;
+                // The completion queue is full: drain it and retry.
+                if (errno == EBUSY && wait == 0) return true;
+                return false;
+            }
+        }
+
+        void Reap(bool dispatch) {
+            unsigned head = *cq_head_;
+            while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe cqe = cqes_[head & cq_mask_];
+                head++;
+                __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+                inflight_--;
+                if (dispatch) Complete(static_cast<Op>(cqe.user_data & 0xff), cqe.user_data >> 8, cqe.res);
+            }
+        }
+
+        void Complete(Op op, uint64_t id, int res) {
+            if (op == Op::Timer) {
+                timer_armed_ = false;
+                SweepIdle();
+                return;
+            }
+            if (op == Op::Write) {
+                auto it = writes_.find(id);
+                if (res <= 0) {
+                    write_failed_ = true;
+                    writes_.erase(it);
+                    return;
+                }
+                it->second.written += res;
+                if (it->second.written < it->second.data.size()) SubmitWrite(id, it->second);
+                else writes_.erase(it);
+                return;
+            }
+
+            auto it = entries_.find(id);
+            if (it == entries_.end()) return;
+            Entry& e = it->second;
+            e.inflight--;
+            if (e.closing) {
+                if (e.inflight == 0) Release(it);
+                return;
+            }
+            e.last_active = std::chrono::steady_clock::now();
+            bool ok = true;
+            switch (op) {
+                case Op::Connect: {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    ok = res >= 0 && getsockopt(e.fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+                    if (!ok) break;
+                    // Blocking from here on: the ring waits for readiness, and
+                    // O_NONBLOCK would only turn that into -EAGAIN.
+                    fcntl(e.fd, F_SETFL, fcntl(e.fd, F_GETFL) & ~O_NONBLOCK);
+                    e.connected = true;
+                    e.conn->OnConnected();
+                    SubmitRead(id, e);
+                    break;
+                }
+                case Op::Read:
+                    if (res == -EAGAIN || res == -EINTR) {
+                        SubmitRead(id, e);
+                        break;
+                    }
+                    ok = res > 0 && e.conn->OnData(std::string_view(e.slot >= 0 ? &slots_[e.slot * SLOT_SIZE] : e.heap_buf.data(), res));
+                    if (ok) SubmitRead(id, e);
+                    break;
+                case Op::Send:
+                    e.send_inflight = false;
+                    ok = res > 0 || res == -EAGAIN || res == -EINTR;
+                    if (res > 0) e.sent += res;
+                    break;
+                default:
+                    break;
+            }
+            if (!ok) {
+                Close(id, e);
+                return;
+            }
+            SubmitSend(id, e);
+        }
+
+        void SubmitRead(uint64_t id, Entry& e) {
+            io_uring_sqe* sqe = Sqe(Op::Read, id);
+            sqe->fd = e.fd;
+            if (e.slot >= 0) {
+                sqe->opcode = IORING_OP_READ_FIXED;
+                sqe->addr = reinterpret_cast<uint64_t>(&slots_[e.slot * SLOT_SIZE]);
+                sqe->buf_index = static_cast<uint16_t>(e.slot);
+                sqe->off = static_cast<uint64_t>(-1);
+            } else {
+                sqe->opcode = IORING_OP_RECV;
+                sqe->addr = reinterpret_cast<uint64_t>(e.heap_buf.data());
+            }
+            sqe->len = SLOT_SIZE;
+            e.inflight++;
+        }
+
+        // One send in flight per connection; a short send is resumed from
+        // where it stopped before anything newer goes out.
+        void SubmitSend(uint64_t id, Entry& e) {
+            if (!e.connected || e.send_inflight) return;
+            if (e.sent == e.sending.size()) {
+                if (e.conn->outbox.empty()) return;
+                e.sending.clear();
+                e.sending.swap(e.conn->outbox);
+                e.sent = 0;
+            }
+            io_uring_sqe* sqe = Sqe(Op::Send, id);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = e.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(e.sending.data() + e.sent);
+            sqe->len = static_cast<uint32_t>(e.sending.size() - e.sent);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            e.send_inflight = true;
+            e.inflight++;
+        }
+
+        void SubmitWrite(uint64_t id, FileWrite& w) {
+            io_uring_sqe* sqe = Sqe(Op::Write, id);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = w.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(w.data.data() + w.written);
+            sqe->len = static_cast<uint32_t>(w.data.size() - w.written);
+            sqe->off = static_cast<uint64_t>(w.offset) + w.written;
+        }
+
+        // The connection is told at once; its fd and buffers are released
+        // once the kernel has finished every operation still using them.
+        void Close(uint64_t id, Entry& e) {
+            e.closing = true;
+            closing_++;
+            shutdown(e.fd, SHUT_RDWR);
+            std::unique_ptr<Connection> conn = std::move(e.conn);
+            conn->OnClosed();
+            auto it = entries_.find(id);
+            if (it->second.inflight == 0) Release(it);
+        }
+
+        void Release(std::unordered_map<uint64_t, Entry>::iterator it) {
+            close(it->second.fd);
+            if (it->second.slot >= 0) free_slots_.push_back(it->second.slot);
+            entries_.erase(it);
+            closing_--;
+        }
+
+        void SweepIdle() {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<uint64_t> idle;
+            for (auto& [id, e] : entries_) {
+                if (!e.closing && !e.conn->wake_at && now - e.last_active > Reactor::IDLE_TIMEOUT) idle.push_back(id);
+            }
+            for (uint64_t id : idle) Close(id, entries_[id]);
+        }
+
+        std::optional<std::chrono::steady_clock::time_point> NextWake() const {
+            std::optional<std::chrono::steady_clock::time_point> wake;
+            for (const auto& [id, e] : entries_) {
+                if (!e.closing && e.conn->wake_at && (!wake || *e.conn->wake_at < *wake)) wake = e.conn->wake_at;
+            }
+            return wake;
+        }
+
+        void Wake() {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<uint64_t> due;
+            for (auto& [id, e] : entries_) {
+                if (!e.closing && e.conn->wake_at && *e.conn->wake_at <= now) due.push_back(id);
+            }
+            for (uint64_t id : due) {
+                auto it = entries_.find(id);
+                if (it == entries_.end() || it->second.closing || stopped_) continue;
+                Entry& e = it->second;
+                e.conn->wake_at.reset();
+                e.last_active = now;
+                if (e.conn->OnWake()) SubmitSend(id, e);
+                else Close(id, e);
+            }
+        }
+
+        int ring_fd_ = -1;
+        void* ring_ = nullptr;
+        size_t ring_size_ = 0;
+        size_t sqes_size_ = 0;
+        unsigned* sq_head_;
+        unsigned* sq_tail_;
+        unsigned sq_mask_;
+        unsigned* sq_array_;
+        unsigned sq_entries_;
+        unsigned* cq_head_;
+        unsigned* cq_tail_;
+        unsigned cq_mask_;
+        io_uring_cqe* cqes_;
+        io_uring_sqe* sqes_;
+        unsigned tail_ = 0;
+        size_t inflight_ = 0;
+
+        std::vector<char> slots_;
+        std::vector<int> free_slots_;
+        std::unordered_map<uint64_t, Entry> entries_;
+        std::unordered_map<uint64_t, FileWrite> writes_;
+        uint64_t next_id_ = 1;
+        size_t closing_ = 0;
+        bool timer_armed_ = false;
+        bool ext_arg_ = false;
+        __kernel_timespec tick_{1, 0};
+    };
+
+    class Client {
+    public:
+        // Accepts a .torrent file or the output of `compile`.
+        static TorrentInfo LoadTorrent(const std::string& path) {
+            auto mapping = std::make_shared<MappedFile>(path);
+            if (CompiledTorrent::Matches(mapping->View())) return CompiledTorrent::Load(std::move(mapping));
+            MetainfoFile file = OrThrow(BBinder::Decode<MetainfoFile>(mapping->View()));
+            const InfoDict& info = file.info.value;
+
+            TorrentInfo t;
+            t.announce = file.announce;
+            t.length = info.length;
+            t.piece_length = info.piece_length;
+            t.pieces = info.pieces;
+            t.name = info.name.value_or(""); 
+            
+            t.info_hash_raw = Utils::CalculateSHA1(file.info.raw);
+            t.info_hash_str = Utils::ToHex(t.info_hash_raw.data(), 20);
+            t.storage = mapping;
+
+            return t;
+        }
+
+        struct Announce {
+            std::string host;
+            std::string port;
+            std::string request;
+        };
+
+        static Announce BuildAnnounce(const TorrentInfo& t) {
+            std::string url = t.announce;
+            if (url.substr(0, 7) == "http://") url = url.substr(7);
+            
+            size_t slash = url.find('/');
+            std::string hostport = url.substr(0, slash);
+            std::string path = url.substr(slash);
+            auto [host, port] = Network::SplitHostPort(hostport);
+            Announce a{host, port.empty() ? "80" : port, ""};
+
+            std::string peer_id = Utils::GeneratePeerId();
+            std::vector<uint8_t> pid_vec(peer_id.begin(), peer_id.end());
+
+            std::ostringstream req;
+            req << "GET " << path 
+                << "?info_hash=" << Utils::UrlEncode(t.info_hash_raw)
+                << "&peer_id=" << Utils::UrlEncode(pid_vec)
+                << "&port=6881&uploaded=0&downloaded=0&compact=1"
+                << "&left=" << t.length 
+                << " HTTP/1.0\r\nHost: " << hostport << "\r\nConnection: close\r\n\r\n";
+            a.request = req.str();
+            return a;
+        }
+
+        // Splits an HTTP response into headers and a bencoded body, parsing
+        // the body as it streams in so the caller can stop reading as soon as
+        // the value is complete instead of waiting for the close.
+        class TrackerReader {
+        public:
+            Result<bool> Feed(std::string_view chunk) {
+                if (!in_body_) {
+                    size_t scanned = headers_.size() < 3 ? 0 : headers_.size() - 3;
+                    headers_.append(chunk);
+                    size_t header_end = headers_.find("\r\n\r\n", scanned);
+                    if (header_end == std::string::npos) return false;
+                    in_body_ = true;
+                    chunk = std::string_view(headers_).substr(header_end + 4);
+                }
+                return body_.Feed(chunk);
+            }
+
+            bool Complete() const { return body_.Complete(); }
+
+            // Called once the connection has closed.
+            std::vector<PeerAddress> Peers() const {
+                if (!in_body_) throw std::runtime_error("Invalid HTTP response");
+                if (!body_.Complete()) throw std::runtime_error("Truncated tracker response");
+                return ParsePeers(body_.Value());
+            }
+
+        private:
+            std::string headers_;
+            bool in_body_ = false;
+            BStreamParser body_;
+        };
+
+        static std::vector<PeerAddress> ParsePeers(std::string_view body) {
+            TrackerResponse tracker_resp = OrThrow(BBinder::Decode<TrackerResponse>(body));
+            if (tracker_resp.failure_reason) throw std::runtime_error("Tracker error: " + std::string(*tracker_resp.failure_reason));
+            if (!tracker_resp.peers && !tracker_resp.peers6) throw std::runtime_error(Error{Errc::MissingField, "peers"}.Message());
+            std::string_view peers_bin = tracker_resp.peers.value_or("");
+
+            std::vector<PeerAddress> peers;
+            for (size_t i = 0; i + 6 <= peers_bin.size(); i += 6) {
+                uint8_t a = peers_bin[i];
+                uint8_t b = peers_bin[i+1];
+                uint8_t c = peers_bin[i+2];
+                uint8_t d = peers_bin[i+3];
+                uint16_t p = (static_cast<uint8_t>(peers_bin[i+4]) << 8) | static_cast<uint8_t>(peers_bin[i+5]);
+                
+                std::string ip = std::to_string(a) + "." + std::to_string(b) + "." + std::to_string(c) + "." + std::to_string(d);
+                peers.push_back({ip, p});
+            }
+
+            // BEP 7: 16-byte address and 2-byte port per peer.
+            std::string_view peers6 = tracker_resp.peers6.value_or("");
+            for (size_t i = 0; i + 18 <= peers6.size(); i += 18) {
+                char ip[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, peers6.data() + i, ip, sizeof(ip));
+                uint16_t p = (static_cast<uint8_t>(peers6[i+16]) << 8) | static_cast<uint8_t>(peers6[i+17]);
+                peers.push_back({ip, p});
+            }
+            return peers;
+        }
+
+        static std::vector<PeerAddress> GetPeers(const TorrentInfo& t) {
+            Announce announce = BuildAnnounce(t);
+            int sock = Connector::ConnectHostname(announce.host, announce.port);
+            if (sock < 0) throw std::runtime_error("Tracker connection failed");
+
+            Network::SendAll(sock, announce.request.data(), announce.request.size());
+            
+            TrackerReader reader;
+            char buf[4096];
+            while (!reader.Complete()) {
+                ssize_t n = recv(sock, buf, sizeof(buf), 0);
+                if (n <= 0) break;
+                Result<bool> fed = reader.Feed(std::string_view(buf, n));
+                if (!fed) {
+                    close(sock);
+                    throw std::runtime_error(fed.error().Message());
+                }
+            }
+            close(sock);
+            return reader.Peers();
+        }
+
+        static std::array<uint8_t, HANDSHAKE_LEN> BuildHandshake(const TorrentInfo& t, bool support_extensions) {
+            PeerWire::Handshake handshake;
+            if (support_extensions) handshake.reserved[5] |= PeerWire::Handshake::EXTENSION_PROTOCOL;
+            std::memcpy(handshake.info_hash.data(), t.info_hash_raw.data(), handshake.info_hash.size());
+            std::string my_id = Utils::GeneratePeerId();
+            std::memcpy(handshake.peer_id.data(), my_id.data(), handshake.peer_id.size());
+            return PeerWire::Encode(handshake);
+        }
+
+        static int PerformHandshake(const std::string& ip, uint16_t port, const TorrentInfo& t, std::vector<uint8_t>& out_peer_id, bool& out_peer_supports_ext, bool support_extensions = false) {
+            int sock = ConnectPeer(ip, port, true);
+            if (sock < 0) throw std::runtime_error("Connection to peer failed");
+            try {
+                Handshake(sock, t, out_peer_id, out_peer_supports_ext, support_extensions);
+            } catch (...) {
+                close(sock);
+                throw;
+            }
+            return sock;
+        }
+
+        // Connects over Network::peer_transport. A blocking uTP connect waits
+        // for the SYN to be answered. A non-blocking one, meant for an
+        // IoLoop, is writable at once: what the connection sends first waits
+        // in the engine until then, and a failed connect reads end-of-file.
+        static int ConnectPeer(const std::string& ip, uint16_t port, bool blocking) {
+            if (Network::peer_transport == Transport::Tcp) return blocking ? Network::Connect(ip, port) : Network::ConnectNonBlocking(ip, port);
+            std::optional<SocketAddress> addr = Network::ParseAddress(ip, port);
+            if (!addr) return -1;
+            Connector::Options options;
+            if (!blocking) return UtpEngine::Shared().Connect(*addr, options.attempt_timeout, false);
+            Connector connector({*addr}, options);
+            return connector.Next();
+        }
+
+        // Handshakes over an already connected socket, which stays open
+        // (and owned by the caller) if this throws.
+        static void Handshake(int sock, const TorrentInfo& t, std::vector<uint8_t>& out_peer_id, bool& out_peer_supports_ext, bool support_extensions = false) {
+            std::array<uint8_t, HANDSHAKE_LEN> handshake = BuildHandshake(t, support_extensions);
+            Network::SendAll(sock, handshake.data(), handshake.size());
+
+            uint8_t response[HANDSHAKE_LEN];
+            OrThrow(Network::RecvAll(sock, response, HANDSHAKE_LEN));
+            PeerWire::Handshake peer = OrThrow(PeerWire::DecodeHandshake(response));
+
+            out_peer_id.assign(peer.peer_id.begin(), peer.peer_id.end());
+            out_peer_supports_ext = peer.Extensions();
+        }
+
+       
+        // Reads a length prefix, rejecting anything no well-behaved peer sends.
+        static Result<uint32_t> ReadLength(FramedReader& peer) {
+            uint32_t len;
+            Result<void> r = peer.Read(&len, 4);
+            if (!r) return std::unexpected(r.error());
+            len = ntohl(len);
+            if (len > MAX_MESSAGE_LEN) return std::unexpected(Error{Errc::Protocol, "message too large"});
+            return len;
+        }
+
+        static Result<void> ReadMessage(FramedReader& peer, std::vector<uint8_t>& buffer) {
+            Result<uint32_t> len = ReadLength(peer);
+            if (!len) return std::unexpected(len.error());
+            buffer.resize(*len);
+            if (*len == 0) return {};
+            return peer.Read(buffer.data(), *len);
+        }
+
+        static void SendExtensionHandshake(int sock) {
+            json handshake_payload;
+            handshake_payload["m"]["ut_metadata"] = 1;
+            SendExtended(sock, 0, handshake_payload);
+        }
+
+        // Encodes `payload` in place after room for the header, then fills
+        // the header in.
+        static void SendExtended(int sock, uint8_t extension, const json& payload) {
+            std::vector<uint8_t> msg(PeerWire::Extended::SIZE);
+            msg.reserve(msg.size() + BEncoder::EncodedSize(payload));
+            BEncoder::EncodeTo(payload, msg);
+            auto header = PeerWire::Encode(PeerWire::Extended{extension, PeerWire::Bytes(msg).subspan(PeerWire::Extended::SIZE)});
+            std::memcpy(msg.data(), header.data(), header.size());
+            Network::SendAll(sock, msg.data(), msg.size());
+        }
+
+        
+        static Result<int> ReceiveExtensionHandshake(FramedReader& peer) {
+            std::vector<uint8_t> msg;
+            while (true) {
+                Result<void> r = ReadMessage(peer, msg);
+                if (!r) return std::unexpected(r.error());
+
+                Result<PeerWire::Extended> extended = PeerWire::Decode<PeerWire::Extended>(msg);
+                if (!extended || extended->extension != 0) continue;
+
+                std::string_view payload(reinterpret_cast<const char*>(extended->payload.data()), extended->payload.size());
+                Result<ExtensionHandshake> decoded = BBinder::Decode<ExtensionHandshake>(payload);
+                if (!decoded) return std::unexpected(decoded.error());
+                if (!decoded->m || !decoded->m->ut_metadata) return std::unexpected(Error{Errc::Protocol, "peer does not support ut_metadata"});
+                return static_cast<int>(*decoded->m->ut_metadata);
+            }
+        }
+
+       static void SendMetadataRequest(int sock, int ext_id, int piece_index) {
+            json payload;
+            payload["msg_type"] = 0;
+            payload["piece"] = piece_index;
+            SendExtended(sock, static_cast<uint8_t>(ext_id), payload);
+        }
+
+        
+       static Result<std::vector<uint8_t>> ReceiveMetadataResponse(FramedReader& peer, int ext_id) {
+            while (true) {
+                Result<uint32_t> len = ReadLength(peer);
+                if (!len) return std::unexpected(len.error());
+                if (*len == 0) continue;
+                
+                uint8_t header[2];
+                uint32_t header_len = std::min<uint32_t>(*len, 2);
+                Result<void> r = peer.Read(header, header_len);
+                if (!r) return std::unexpected(r.error());
+                size_t remaining = *len - header_len;
+                
+                Result<PeerWire::Extended> extended = PeerWire::Decode<PeerWire::Extended>(PeerWire::Bytes(header, header_len));
+                if (!extended || extended->extension != ext_id) {
+                    r = peer.Discard(remaining);
+                    if (!r) return std::unexpected(r.error());
+                    continue;
+                }
+                
+                // Stream the payload through the push parser: the dict is
+                // recognised as soon as its last byte arrives, and the rest of
+                // the message is read straight into the metadata buffer.
+                BStreamParser parser;
+                char buf[256];
+                while (!parser.Complete() && remaining > 0) {
+                    size_t n = std::min(remaining, sizeof(buf));
+                    r = peer.Read(buf, n);
+                    if (!r) return std::unexpected(r.error());
+                    remaining -= n;
+                    Result<bool> fed = parser.Feed(std::string_view(buf, n));
+                    if (!fed) return std::unexpected(fed.error());
+                }
+                if (!parser.Complete()) continue;
+                
+                Result<MetadataMessage> header_dict = BBinder::Decode<MetadataMessage>(parser.Value());
+                if (!header_dict) return std::unexpected(header_dict.error());
+                long long msg_type = header_dict->msg_type;
+                
+                if (msg_type == 1) {
+                    std::string_view head = parser.Trailing();
+                    std::vector<uint8_t> metadata(head.size() + remaining);
+                    std::memcpy(metadata.data(), head.data(), head.size());
+                    r = peer.Read(metadata.data() + head.size(), remaining);
+                    if (!r) return std::unexpected(r.error());
+                    return metadata;
+                }
+                
+                r = peer.Discard(remaining);
+                if (!r) return std::unexpected(r.error());
+                if (msg_type == 2) return std::unexpected(Error{Errc::Rejected, "metadata request"});
+            }
+        }
+
+       
+        static Result<void> WaitForUnchoke(FramedReader& peer) {
+            auto interested = PeerWire::Encode(PeerWire::Interested{});
+            Network::SendAll(peer.Socket(), interested.data(), interested.size());
+
+            while (true) {
+                Result<uint32_t> msg_len = ReadLength(peer);
+                if (!msg_len) return std::unexpected(msg_len.error());
+                if (*msg_len == 0) continue;
+
+                uint8_t msg_id;
+                Result<void> r = peer.Read(&msg_id, 1);
+                if (!r) return r;
+
+                if (static_cast<PeerWire::Id>(msg_id) == PeerWire::Id::Unchoke) return {};
+
+                r = peer.Discard(*msg_len - 1);
+                if (!r) return r;
+            }
+        }
+
+        static int PieceCount(const TorrentInfo& t) {
+            return static_cast<int>((t.length + t.piece_length - 1) / t.piece_length);
+        }
+
+        static long long PieceSize(const TorrentInfo& t, int piece_idx) {
+            if (piece_idx == PieceCount(t) - 1) {
+                long long rem = t.length % t.piece_length;
+                if (rem != 0) return rem;
+            }
+            return t.piece_length;
+        }
+
+        // Which of a piece's blocks `begin` and `len` are, if they match
+        // exactly one block as it is requested.
+        static std::optional<int> BlockOf(long long piece_size, uint32_t begin, size_t len) {
+            if (begin % BLOCK_SIZE != 0 || begin >= piece_size) return std::nullopt;
+            if (len != static_cast<size_t>(std::min<long long>(BLOCK_SIZE, piece_size - begin))) return std::nullopt;
+            return static_cast<int>(begin / BLOCK_SIZE);
+        }
+
+        static bool VerifyPiece(const TorrentInfo& t, int piece_idx, const std::vector<uint8_t>& piece_data) {
+            std::vector<uint8_t> hash = Utils::CalculateSHA1(piece_data);
+            std::string_view expected_hash_str = t.pieces.substr(piece_idx * 20, 20);
+            return std::memcmp(hash.data(), expected_hash_str.data(), 20) == 0;
+        }
+
+        // Requests are charged to the limits `peer` is throttled to.
+        static Result<std::vector<uint8_t>> DownloadPiece(FramedReader& peer, const TorrentInfo& t, int piece_idx) {
+            long long current_piece_size = PieceSize(t, piece_idx);
+
+            int block_count = (current_piece_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+            Bandwidth* torrent_limit = peer.TorrentLimit();
+            Bandwidth* peer_limit = peer.PeerLimit();
+            FramedWriter requests(peer.Socket());
+            requests.Throttle(torrent_limit, peer_limit);
+            for (int i = 0; i < block_count; i++) {
+                int begin = i * BLOCK_SIZE;
+                int len = BLOCK_SIZE;
+                if (begin + len > current_piece_size) len = current_piece_size - begin;
+
+                // Over the download limit: send what is queued and hold the
+                // rest of the requests back until the buckets refill.
+                std::chrono::nanoseconds wait = Bandwidth::ReserveDownload(len, torrent_limit, peer_limit);
+                if (wait.count() > 0) {
+                    Result<void> sent = requests.Flush();
+                    if (!sent) return std::unexpected(sent.error());
+                    std::this_thread::sleep_for(wait);
+                }
+
+                auto request = PeerWire::Encode(PeerWire::Request{static_cast<uint32_t>(piece_idx), static_cast<uint32_t>(begin), static_cast<uint32_t>(len)});
+                requests.Push(request.data(), request.size());
+            }
+            Result<void> sent = requests.Flush();
+            if (!sent) return std::unexpected(sent.error());
+            
+            std::vector<uint8_t> piece_data(current_piece_size);
+            std::vector<bool> arrived(block_count);
+            int remaining = block_count;
+
+            while (remaining > 0) {
+                Result<uint32_t> msg_len = ReadLength(peer);
+                if (!msg_len) return std::unexpected(msg_len.error());
+
+                if (*msg_len == 0) continue; 
+
+                uint8_t head[PeerWire::Piece::SIZE - 4];
+                Result<void> r = peer.Read(head, 1);
+                if (!r) return std::unexpected(r.error());
+
+                if (static_cast<PeerWire::Id>(head[0]) == PeerWire::Id::Piece) {
+                    if (*msg_len < sizeof(head)) return std::unexpected(Error{Errc::Protocol, "short piece message"});
+                    r = peer.Read(head + 1, sizeof(head) - 1);
+                    if (!r) return std::unexpected(r.error());
+                    Result<PeerWire::Piece> header = PeerWire::Decode<PeerWire::Piece>(head);
+                    if (!header) return std::unexpected(header.error());
+                    uint32_t data_len = *msg_len - sizeof(head);
+                    std::optional<int> block = BlockOf(current_piece_size, header->begin, data_len);
+                    // Blocks of other pieces, ones we did not ask for, and
+                    // repeats are dropped.
+                    if (static_cast<int>(header->piece) == piece_idx && block && !arrived[*block]) {
+                        r = peer.Read(piece_data.data() + header->begin, data_len);
+                        arrived[*block] = true;
+                        remaining--;
+                    } else {
+                        r = peer.Discard(data_len);
+                    }
+                    if (!r) return std::unexpected(r.error());
+                } else {
+                    r = peer.Discard(*msg_len - 1);
+                    if (!r) return std::unexpected(r.error());
+                }
+            }
+
+            if (!VerifyPiece(t, piece_idx, piece_data)) return std::unexpected(Error{Errc::HashMismatch, {}});
+
+            return piece_data;
+        }
+    };
+
+    // Download state shared by every connection of one torrent: which pieces
+    // are still wanted, and the file they are written to.
+    class Swarm {
+    public:
+        Swarm(const TorrentInfo& t, int out_fd, std::function<void(int)> on_piece)
+            : torrent(t), out_fd_(out_fd), on_piece_(std::move(on_piece)) {
+            for (int i = 0; i < Client::PieceCount(t); i++) wanted_.push_back(i);
+        }
+
+        std::optional<int> Take() {
+            if (wanted_.empty()) return std::nullopt;
+            int piece = wanted_.front();
+            wanted_.pop_front();
+            return piece;
+        }
+
+        // Puts back a piece whose download was abandoned.
+        void Return(int piece) { wanted_.push_back(piece); }
+
+        // Hands a verified piece to `loop` to be written at its place in the
+        // output file.
+        void Complete(IoLoop& loop, int piece, std::vector<uint8_t> data) {
+            loop.WriteFile(out_fd_, std::move(data), static_cast<off_t>(piece) * torrent.piece_length);
+            completed_++;
+            if (on_piece_) on_piece_(piece);
+        }
+
+        bool Done() const { return completed_ == Client::PieceCount(torrent); }
+
+        const TorrentInfo& torrent;
+        // Why the download cannot finish, if something fatal went wrong.
+        std::string error;
+
+    private:
+        int out_fd_;
+        std::function<void(int)> on_piece_;
+        std::deque<int> wanted_;
+        int completed_ = 0;
+    };
+
+    // One peer of a Swarm: handshake, interested, then keeps up to PIPELINE
+    // block requests outstanding on one piece at a time until none are left.
+    class PeerConnection : public Connection {
+    public:
+        static constexpr int PIPELINE = 16;
+
+        PeerConnection(Swarm& swarm, const std::string& address)
+            : swarm_(swarm), torrent_limit_(Bandwidth::Torrent(swarm.torrent.info_hash_str)), peer_limit_(Bandwidth::Peer(address)) {}
+
+        bool OnWake() override { return Request(); }
+
+        void OnConnected() override {
+            Append(Client::BuildHandshake(swarm_.torrent, false));
+        }
+
+        bool OnData(std::string_view data) override {
+            if (handshaken_) return Consume(data);
+            in_.append(data);
+            if (in_.size() < HANDSHAKE_LEN) return true;
+            Result<PeerWire::Handshake> peer = PeerWire::DecodeHandshake(PeerWire::View(in_).first(HANDSHAKE_LEN));
+            if (!peer || std::memcmp(peer->info_hash.data(), swarm_.torrent.info_hash_raw.data(), 20) != 0) return false;
+            handshaken_ = true;
+            Append(PeerWire::Encode(PeerWire::Interested{}));
+            std::string rest = in_.substr(HANDSHAKE_LEN);
+            in_.clear();
+            return Consume(rest);
+        }
+
+        void OnClosed() override {
+            if (piece_ >= 0) swarm_.Return(piece_);
+        }
+
+    private:
+        template <size_t N>
+        void Append(const std::array<uint8_t, N>& bytes) {
+            outbox.append(reinterpret_cast<const char*>(bytes.data()), N);
+        }
+
+        // Handles every complete message in `data` where it lies. Only a
+        // trailing partial message is kept in in_, except that a piece
+        // message is streamed into piece_data_ as soon as its header has
+        // arrived, so block payloads are never staged.
+        bool Consume(std::string_view data) {
+            std::string_view buf = data;
+            if (!in_.empty()) {
+                in_.append(data);
+                buf = in_;
+            }
+            size_t pos = 0;
+            while (true) {
+                if (block_left_ > 0) {
+                    std::string_view part = buf.substr(pos, block_left_);
+                    StoreBlock(part);
+                    pos += part.size();
+                    if (block_left_ > 0) break;
+                    if (!FinishBlock()) return false;
+                    continue;
+                }
+                if (buf.size() - pos < 4) break;
+                uint32_t len;
+                std::memcpy(&len, buf.data() + pos, 4);
+                len = ntohl(len);
+                if (len > MAX_MESSAGE_LEN) return false;
+                std::string_view rest = buf.substr(pos + 4);
+                if (rest.size() >= len) {
+                    if (!OnMessage(rest.substr(0, len))) return false;
+                    pos += 4 + len;
+                } else if (len >= 9 && rest.size() >= 9 && static_cast<PeerWire::Id>(rest[0]) == PeerWire::Id::Piece) {
+                    StartBlock(rest.substr(0, 9), len - 9);
+                    pos += 4 + 9;
+                } else {
+                    break;
+                }
+            }
+            if (buf.data() == in_.data()) in_.erase(0, pos);
+            else in_.assign(buf.substr(pos));
+            return true;
+        }
+
+        // `head` is the id and header of a piece message whose `len` payload
+        // bytes follow.
+        void StartBlock(std::string_view head, size_t len) {
+            PeerWire::Piece header = *PeerWire::Decode<PeerWire::Piece>(PeerWire::View(head));
+            block_at_ = header.begin;
+            block_left_ = len;
+            std::optional<int> block = Client::BlockOf(piece_data_.size(), header.begin, len);
+            block_wanted_ = piece_ >= 0 && static_cast<int>(header.piece) == piece_ && block && !arrived_[*block];
+            if (block_wanted_) arrived_[*block] = true;
+        }
+
+        void StoreBlock(std::string_view part) {
+            if (block_wanted_) std::memcpy(piece_data_.data() + block_at_, part.data(), part.size());
+            block_at_ += part.size();
+            block_left_ -= part.size();
+        }
+
+        bool FinishBlock() {
+            if (!block_wanted_) return true;
+            in_flight_--;
+            if (++received_ == arrived_.size()) {
+                if (Client::VerifyPiece(swarm_.torrent, piece_, piece_data_)) {
+                    swarm_.Complete(Loop(), piece_, std::move(piece_data_));
+                    if (swarm_.Done()) Loop().Stop();
+                } else {
+                    swarm_.Return(piece_);
+                }
+                piece_ = -1;
+            }
+            return Request();
+        }
+
+        bool OnMessage(std::string_view msg) {
+            if (msg.empty()) return true;
+            switch (static_cast<PeerWire::Id>(msg[0])) {
+                case PeerWire::Id::Choke:
+                    choked_ = true;
+                    // A choke discards our outstanding requests.
+                    if (piece_ >= 0) swarm_.Return(piece_);
+                    piece_ = -1;
+                    return true;
+                case PeerWire::Id::Unchoke:
+                    choked_ = false;
+                    return Request();
+                case PeerWire::Id::Piece:
+                    if (msg.size() < 9) return false;
+                    StartBlock(msg.substr(0, 9), msg.size() - 9);
+                    StoreBlock(msg.substr(9));
+                    return FinishBlock();
+                default:
+                    return true;
+            }
+        }
+
+        bool Request() {
+            if (choked_) return true;
+            if (piece_ < 0) {
+                std::optional<int> next = swarm_.Take();
+                // Nothing left for this peer to fetch.
+                if (!next) return false;
+                piece_ = *next;
+                piece_data_.assign(Client::PieceSize(swarm_.torrent, piece_), 0);
+                arrived_.assign((piece_data_.size() + BLOCK_SIZE - 1) / BLOCK_SIZE, false);
+                requested_ = received_ = 0;
+                in_flight_ = 0;
+            }
+            while (in_flight_ < PIPELINE && requested_ < piece_data_.size()) {
+                // Waiting for the download limits to allow the next request.
+                if (wake_at) return true;
+                uint32_t len = static_cast<uint32_t>(std::min<size_t>(BLOCK_SIZE, piece_data_.size() - requested_));
+                if (!reserved_) {
+                    reserved_ = true;
+                    std::chrono::nanoseconds wait = Bandwidth::ReserveDownload(len, torrent_limit_.get(), peer_limit_.get());
+                    if (wait.count() > 0) {
+                        wake_at = std::chrono::steady_clock::now() + wait;
+                        return true;
+                    }
+                }
+                reserved_ = false;
+                Append(PeerWire::Encode(PeerWire::Request{static_cast<uint32_t>(piece_), static_cast<uint32_t>(requested_), len}));
+                requested_ += len;
+                in_flight_++;
+            }
+            return true;
+        }
+
+        Swarm& swarm_;
+        Bandwidth::Handle torrent_limit_;
+        Bandwidth::Handle peer_limit_;
+        // The next request's bytes are already charged to the limits.
+        bool reserved_ = false;
+        std::string in_;
+        bool handshaken_ = false;
+        bool choked_ = true;
+        int piece_ = -1;
+        std::vector<uint8_t> piece_data_;
+        size_t requested_ = 0;
+        // Blocks of piece_ received so far, and which ones.
+        size_t received_ = 0;
+        std::vector<bool> arrived_;
+        int in_flight_ = 0;
+        size_t block_at_ = 0;
+        size_t block_left_ = 0;
+        bool block_wanted_ = false;
+    };
+
+    // Announces a Swarm to its tracker and starts a PeerConnection for each
+    // peer returned, up to `max_peers`.
+    class TrackerConnection : public Connection {
+    public:
+        TrackerConnection(Swarm& swarm, std::string request, size_t max_peers)
+            : swarm_(swarm), request_(std::move(request)), max_peers_(max_peers) {}
+
+        void OnConnected() override {
+            connected_ = true;
+            outbox = request_;
+        }
+
+        bool OnData(std::string_view data) override {
+            Result<bool> fed = reader_.Feed(data);
+            if (!fed) {
+                swarm_.error = fed.error().Message();
+                return false;
+            }
+            if (*fed) Finish();
+            return !*fed;
+        }
+
+        void OnClosed() override {
+            if (!connected_) swarm_.error = "Tracker connection failed";
+            else if (!finished_) Finish();
+        }
+
+    private:
+        void Finish() {
+            finished_ = true;
+            std::vector<PeerAddress> peers;
+            try {
+                peers = reader_.Peers();
+            } catch (const std::exception& e) {
+                swarm_.error = e.what();
+                return;
+            }
+            for (size_t i = 0; i < peers.size() && i < max_peers_; i++) {
+                int fd = Client::ConnectPeer(peers[i].ip, peers[i].port, false);
+                if (fd >= 0) Loop().Add(fd, std::make_unique<PeerConnection>(swarm_, Network::FormatHostPort(peers[i].ip, peers[i].port)));
+            }
+        }
+
+        Swarm& swarm_;
+        std::string request_;
+        size_t max_peers_;
+        Client::TrackerReader reader_;
+        bool connected_ = false;
+        bool finished_ = false;
+    };
+
+    class Downloader {
+    public:
+        // Downloads the whole torrent into `output` through `loop`, with
+        // every peer the tracker returns (up to `max_peers`) working at once.
+        static void Run(IoLoop& loop, const TorrentInfo& t, const std::string& output, std::function<void(int)> on_piece, size_t max_peers = 200) {
+            int out_fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out_fd < 0) throw std::runtime_error("Cannot open file: " + output);
+            Swarm swarm(t, out_fd, std::move(on_piece));
+            Client::Announce announce = Client::BuildAnnounce(t);
+            int fd = Connector::ConnectHostname(announce.host, announce.port, false);
+            if (fd < 0) {
+                close(out_fd);
+                throw std::runtime_error("Tracker connection failed");
+            }
+            loop.Add(fd, std::make_unique<TrackerConnection>(swarm, announce.request, max_peers));
+            loop.Run();
+            close(out_fd);
+            if (loop.WriteFailed()) throw std::runtime_error("Cannot write output file");
+            if (!swarm.Done()) throw std::runtime_error(swarm.error.empty() ? "Download incomplete: no peers left" : swarm.error);
+        }
+    };
+
+    // On-disk record of one torrent in a Catalog. Integers are in host byte
+    // order: a catalog is a local startup cache, not an interchange format.
+    struct CatalogEntry {
+        uint8_t info_hash[20];
+        uint32_t name_length;
+        uint64_t name_offset;
+        int64_t length;
+        int64_t piece_length;
+        uint64_t pieces_offset;
+        uint64_t pieces_length;
+    };
+    static_assert(sizeof(CatalogEntry) == 64);
+
+    // Read-only view of a file written by Catalog::Write: a header, entries
+    // sorted by info hash, then the names and piece hashes they point into.
+    // Opening maps the file and checks bounds; nothing is parsed or copied.
+    class Catalog {
+    public:
+        static constexpr char MAGIC[8] = {'B', 'T', 'C', 'A', 'T', 'L', 'G', '1'};
+
+        explicit Catalog(const std::string& path) : file_(path) {
+            std::string_view data = file_.View();
+            if (data.size() < HEADER_SIZE || std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+                throw std::runtime_error("Not a torrent catalog");
+            }
+            uint64_t count;
+            std::memcpy(&count, data.data() + sizeof(MAGIC), sizeof(count));
+            if (count > (data.size() - HEADER_SIZE) / sizeof(CatalogEntry)) throw std::runtime_error("Truncated catalog");
+            entries_ = reinterpret_cast<const CatalogEntry*>(data.data() + HEADER_SIZE);
+            count_ = static_cast<size_t>(count);
+            for (size_t i = 0; i < count_; i++) {
+                const CatalogEntry& e = entries_[i];
+                if (e.name_offset > data.size() || e.name_length > data.size() - e.name_offset ||
+                    e.pieces_offset > data.size() || e.pieces_length > data.size() - e.pieces_offset ||
+                    e.pieces_length % PIECE_HASH_LEN != 0) {
+                    throw std::runtime_error("Corrupt catalog entry");
+                }
+            }
+        }
+
+        size_t Size() const { return count_; }
+        const CatalogEntry& Entry(size_t i) const { return entries_[i]; }
+
+        const CatalogEntry* Find(const std::vector<uint8_t>& info_hash) const {
+            if (info_hash.size() != sizeof(CatalogEntry::info_hash)) return nullptr;
+            const CatalogEntry* end = entries_ + count_;
+            const CatalogEntry* it = std::lower_bound(entries_, end, info_hash, [](const CatalogEntry& e, const std::vector<uint8_t>& h) {
+                return std::memcmp(e.info_hash, h.data(), sizeof(e.info_hash)) < 0;
+            });
+            if (it == end || std::memcmp(it->info_hash, info_hash.data(), sizeof(it->info_hash)) != 0) return nullptr;
+            return it;
+        }
+
+        std::string_view Name(const CatalogEntry& e) const { return file_.View().substr(e.name_offset, e.name_length); }
+        std::string_view Pieces(const CatalogEntry& e) const { return file_.View().substr(e.pieces_offset, e.pieces_length); }
+
+        // Parses every path with Client::LoadTorrent on `threads` workers.
+        // Results keep input order; a file that fails to load is left out and
+        // reported in `failures` as (path, error).
+        static std::vector<TorrentInfo> LoadAll(const std::vector<std::string>& paths, unsigned threads,
+                                                std::vector<std::pair<std::string, std::string>>& failures) {
+            std::vector<std::optional<TorrentInfo>> loaded(paths.size());
+            std::vector<std::string> errors(paths.size());
+            std::atomic<size_t> next{0};
+            auto worker = [&] {
+                for (size_t i = next++; i < paths.size(); i = next++) {
+                    try {
+                        TorrentInfo t = Client::LoadTorrent(paths[i]);
+                        // Copy the piece hashes out so that the file mapping
+                        // is released now rather than held for the whole run.
+                        auto pieces = std::make_shared<std::string>(t.pieces);
+                        t.pieces = *pieces;
+                        t.storage = pieces;
+                        loaded[i] = std::move(t);
+                    } catch (const std::exception& e) {
+                        errors[i] = e.what();
+                    }
+                }
+            };
+            std::vector<std::thread> pool;
+            for (unsigned i = 1; i < threads && i < paths.size(); i++) pool.emplace_back(worker);
+            worker();
+            for (auto& th : pool) th.join();
+
+            std::vector<TorrentInfo> out;
+            out.reserve(paths.size());
+            for (size_t i = 0; i < paths.size(); i++) {
+                if (loaded[i]) out.push_back(std::move(*loaded[i]));
+                else failures.emplace_back(paths[i], errors[i]);
+            }
+            return out;
+        }
+
+        // Writes `torrents` as a catalog, keeping the first of any duplicate
+        // info hashes. Returns the number of entries written.
+        static size_t Write(const std::string& path, std::vector<TorrentInfo> torrents) {
+            std::stable_sort(torrents.begin(), torrents.end(), [](const TorrentInfo& a, const TorrentInfo& b) {
+                return std::memcmp(a.info_hash_raw.data(), b.info_hash_raw.data(), 20) < 0;
+            });
+            torrents.erase(std::unique(torrents.begin(), torrents.end(), [](const TorrentInfo& a, const TorrentInfo& b) {
+                return std::memcmp(a.info_hash_raw.data(), b.info_hash_raw.data(), 20) == 0;
+            }), torrents.end());
+
+            std::vector<CatalogEntry> entries(torrents.size());
+            uint64_t offset = HEADER_SIZE + entries.size() * sizeof(CatalogEntry);
+            for (size_t i = 0; i < torrents.size(); i++) {
+                const TorrentInfo& t = torrents[i];
+                CatalogEntry& e = entries[i];
+                std::memcpy(e.info_hash, t.info_hash_raw.data(), sizeof(e.info_hash));
+                e.name_length = static_cast<uint32_t>(t.name.size());
+                e.name_offset = offset;
+                offset += t.name.size();
+                e.length = t.length;
+                e.piece_length = t.piece_length;
+            }
+            for (size_t i = 0; i < torrents.size(); i++) {
+                entries[i].pieces_offset = offset;
+                entries[i].pieces_length = torrents[i].pieces.size();
+                offset += torrents[i].pieces.size();
+            }
+
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            if (!out) throw std::runtime_error("Cannot open file: " + path);
+            uint64_t count = entries.size();
+            out.write(MAGIC, sizeof(MAGIC));
+            out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(CatalogEntry));
+            for (const auto& t : torrents) out.write(t.name.data(), t.name.size());
+            for (const auto& t : torrents) out.write(t.pieces.data(), t.pieces.size());
+            if (!out.flush()) throw std::runtime_error("Cannot write file: " + path);
+            return entries.size();
+        }
+
+    private:
+        static constexpr size_t HEADER_SIZE = sizeof(MAGIC) + sizeof(uint64_t);
+
+        MappedFile file_;
+        const CatalogEntry* entries_ = nullptr;
+        size_t count_ = 0;
+    };
+
+    // A tracker and `peers` seeders on 127.0.0.1, all serving one in-memory
+    // torrent of random data, for benchmarks. Seeders use blocking sockets
+    // and a thread per connection, and assume the torrent is complete.
+    class LoopbackSwarm {
+    public:
+        // With `dual_stack`, every second seeder listens on ::1 and is listed
+        // in the tracker's peers6. With Transport::Utp, seeders accept uTP
+        // only, each on its own engine.
+        LoopbackSwarm(size_t peers, size_t size, long long piece_length, bool dual_stack = false, Transport transport = Transport::Tcp) {
+            auto data = std::make_shared<std::string>(size, '\0');
+            std::mt19937 rng(5);
+            for (auto& c : *data) c = static_cast<char>(rng());
+            auto pieces = std::make_shared<std::string>();
+            for (size_t off = 0; off < size; off += piece_length) {
+                std::vector<uint8_t> hash = Utils::CalculateSHA1(std::string_view(*data).substr(off, piece_length));
+                pieces->append(hash.begin(), hash.end());
+            }
+            data_ = data;
+
+            torrent.length = static_cast<long long>(size);
+            torrent.piece_length = piece_length;
+            torrent.pieces = *pieces;
+            torrent.storage = pieces;
+            torrent.name = "loopback";
+            torrent.info_hash_raw = Utils::CalculateSHA1(*pieces);
+            torrent.info_hash_str = Utils::ToHex(torrent.info_hash_raw.data(), 20);
+
+            std::string compact, compact6;
+            for (size_t i = 0; i < peers; i++) {
+                bool v6 = dual_stack && i % 2 == 1;
+                auto seed = [data, info_hash = torrent.info_hash_raw, piece_length](int c) { Seed(c, *data, info_hash, piece_length); };
+                uint16_t port;
+                if (transport == Transport::Utp) {
+                    engines_.push_back(std::make_unique<UtpEngine>(*Network::ParseAddress(v6 ? "::1" : "127.0.0.1", 0), true));
+                    port = engines_.back()->Port();
+                    Serve([engine = engines_.back().get()] { return engine->Accept(); }, seed);
+                } else {
+                    Accept(Listen(port, v6), seed);
+                }
+                uint16_t nport = htons(port);
+                if (v6) {
+                    compact6.append(reinterpret_cast<const char*>(&in6addr_loopback), 16);
+                    compact6.append(reinterpret_cast<const char*>(&nport), 2);
+                } else {
+                    uint32_t ip = htonl(INADDR_LOOPBACK);
+                    compact.append(reinterpret_cast<const char*>(&ip), 4);
+                    compact.append(reinterpret_cast<const char*>(&nport), 2);
+                }
+            }
+            std::string body = "d8:intervali60e5:peers" + std::to_string(compact.size()) + ":" + compact;
+            if (dual_stack) body += "6:peers6" + std::to_string(compact6.size()) + ":" + compact6;
+            body += "e";
+            uint16_t port;
+            int fd = Listen(port, false);
+            Accept(fd, [body](int c) { Track(c, body); });
+            torrent.announce = "http://127.0.0.1:" + std::to_string(port) + "/announce";
+        }
+
+        ~LoopbackSwarm() {
+            for (int fd : listeners_) shutdown(fd, SHUT_RDWR);
+            for (auto& engine : engines_) engine->Stop();
+            for (auto& t : acceptors_) t.join();
+            for (int fd : listeners_) close(fd);
+        }
+
+        LoopbackSwarm(const LoopbackSwarm&) = delete;
+        LoopbackSwarm& operator=(const LoopbackSwarm&) = delete;
+
+        std::string_view Data() const { return *data_; }
+
+        TorrentInfo torrent;
+
+    private:
+        int Listen(uint16_t& port, bool v6) {
+            SocketAddress addr = *Network::ParseAddress(v6 ? "::1" : "127.0.0.1", 0);
+            int fd = socket(addr.storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || bind(fd, addr.Get(), addr.length) < 0 || listen(fd, 128) < 0 ||
+                getsockname(fd, reinterpret_cast<sockaddr*>(&addr.storage), &addr.length) < 0) {
+                throw std::runtime_error("Cannot listen on loopback");
+            }
+            port = ntohs(reinterpret_cast<sockaddr_in*>(&addr.storage)->sin_port);
+            listeners_.push_back(fd);
+            return fd;
         }
 
-        static void SendAll(int sock, const void* data, size_t len) {
-            if (send(sock, data, len, 0) < 0) throw std::runtime_error("Send failed");
+        // Connection threads are detached and own what they use, so they
+        // may outlive the swarm.
+        void Accept(int fd, std::function<void(int)> serve) {
+            Serve([fd] {
+                while (true) {
+                    int c = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+                    if (c >= 0 || (errno != EINTR && errno != ECONNABORTED)) return c;
+                }
+            }, std::move(serve));
         }
 
-        static void RecvAll(int sock, void* buffer, size_t len) {
-            size_t received = 0;
-            uint8_t* ptr = static_cast<uint8_t*>(buffer);
-            while (received < len) {
-                ssize_t r = recv(sock, ptr + received, len - received, 0);
-                if (r <= 0) throw std::runtime_error("Receive failed or connection closed");
-                received += r;
+        // Runs `serve` on a new thread for each socket `next` returns, until
+        // it returns -1.
+        void Serve(std::function<int()> next, std::function<void(int)> serve) {
+            acceptors_.emplace_back([next, serve] {
+                while (true) {
+                    int c = next();
+                    if (c < 0) return;
+                    std::thread([c, serve] {
+                        serve(c);
+                        close(c);
+                    }).detach();
+                }
+            });
+        }
+
+        static void Track(int c, const std::string& body) {
+            std::string request;
+            char buf[1024];
+            while (request.find("\r\n\r\n") == std::string::npos) {
+                ssize_t n = recv(c, buf, sizeof(buf), 0);
+                if (n <= 0) return;
+                request.append(buf, n);
             }
+            std::string response = "HTTP/1.0 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+            send(c, response.data(), response.size(), MSG_NOSIGNAL);
         }
-        
-        static std::vector<uint8_t> RecvUntilClosed(int sock) {
-            std::vector<uint8_t> data;
-            char buf[4096];
-            ssize_t n;
-            while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) {
-                data.insert(data.end(), buf, buf + n);
+
+        static void Seed(int c, const std::string& data, const std::vector<uint8_t>& info_hash, long long piece_length) {
+            uint8_t received[HANDSHAKE_LEN];
+            if (!Network::RecvAll(c, received, sizeof(received)) || !PeerWire::DecodeHandshake(received)) return;
+            PeerWire::Handshake reply;
+            std::memcpy(reply.info_hash.data(), info_hash.data(), 20);
+            std::memcpy(reply.peer_id.data(), "-LB0001-000000000000", 20);
+            auto handshake = PeerWire::Encode(reply);
+            if (send(c, handshake.data(), handshake.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(handshake.size())) return;
+            FramedReader reader(c);
+            FramedWriter writer(c);
+            Bandwidth::Handle torrent = Bandwidth::Torrent(Utils::ToHex(info_hash.data(), 20));
+            writer.Throttle(torrent.get(), nullptr);
+            std::vector<uint8_t> msg;
+            while (Client::ReadMessage(reader, msg)) {
+                Result<PeerWire::Message> decoded = PeerWire::Decode(msg);
+                if (!decoded) continue;
+                if (std::holds_alternative<PeerWire::Interested>(*decoded)) {
+                    auto unchoke = PeerWire::Encode(PeerWire::Unchoke{});
+                    writer.Push(unchoke.data(), unchoke.size());
+                } else if (const auto* request = std::get_if<PeerWire::Request>(&*decoded)) {
+                    size_t offset = static_cast<size_t>(request->piece) * piece_length + request->begin;
+                    size_t len = request->length;
+                    if (offset > data.size() || len > data.size() - offset) return;
+                    PeerWire::Bytes block = PeerWire::View(data).subspan(offset, len);
+                    auto header = PeerWire::Encode(PeerWire::Piece{request->piece, request->begin, block});
+                    writer.Push(header.data(), header.size());
+                    writer.Borrow(block.data(), block.size());
+                }
+                // Answer every request that arrived together in one send.
+                if (reader.Buffered() == 0 && !writer.Empty() && !writer.Flush()) return;
             }
-            return data;
         }
+
+        std::shared_ptr<std::string> data_;
+        std::vector<int> listeners_;
+        std::vector<std::unique_ptr<UtpEngine>> engines_;
+        std::vector<std::thread> acceptors_;
     };
 
-    class Client {
+    class Bench {
     public:
-        static TorrentInfo LoadTorrent(const std::string& path) {
-            std::ifstream in(path, std::ios::binary);
-            if (!in) throw std::runtime_error("Cannot open file");
-            
-            std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
-            json root = BEncoder::Decode(content);
-            json info = root["info"];
+        static int Run(int argc, char* argv[]) {
+            if (argc < 3) {
+                std::cerr << "Usage: " << argv[0] << " bench <decode|garbage|framing|startup|swarm|connect|sockets|dns|shaping|utp|wire> [args...]\n";
+                return 1;
+            }
+            std::string which = argv[2];
+            if (which == "decode") return Decode(argc - 3, argv + 3);
+            if (which == "garbage") return Garbage(argc - 3, argv + 3);
+            if (which == "framing") return Framing(argc - 3, argv + 3);
+            if (which == "startup") return Startup(argc - 3, argv + 3);
+            if (which == "swarm") return Loopback(argc - 3, argv + 3);
+            if (which == "connect") return Connect(argc - 3, argv + 3);
+            if (which == "sockets") return Sockets(argc - 3, argv + 3);
+            if (which == "dns") return Dns(argc - 3, argv + 3);
+            if (which == "shaping") return Shaping(argc - 3, argv + 3);
+            if (which == "utp") return Utp(argc - 3, argv + 3);
+            if (which == "wire") return Wire(argc - 3, argv + 3);
+            std::cerr << "Unknown benchmark: " << which << "\n";
+            return 1;
+        }
 
-            TorrentInfo t;
-            t.announce = root["announce"].get<std::string>();
-            t.length = info["length"].get<long long>();
-            t.piece_length = info["piece length"].get<long long>();
-            t.pieces = info["pieces"].get<std::string>();
-            t.name = info["name"].get<std::string>(); 
-            
-            std::string encoded_info = BEncoder::Encode(info);
-            t.info_hash_raw = Utils::CalculateSHA1(encoded_info);
-            t.info_hash_str = Utils::ToHex(t.info_hash_raw.data(), 20);
+    private:
+        template <typename Fn>
+        static double SecondsPerRun(int iterations, Fn&& fn) {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) fn();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count() / iterations;
+        }
 
-            return t;
+        static void Report(const std::string& label, size_t bytes, double seconds) {
+            std::cout << "  " << std::left << std::setw(18) << label << std::right << std::fixed << std::setprecision(3)
+                      << std::setw(10) << seconds * 1e3 << " ms" << std::setw(10) << std::setprecision(1)
+                      << bytes / seconds / 1e6 << " MB/s\n";
         }
 
-        static std::vector<PeerAddress> GetPeers(const TorrentInfo& t) {
-            std::string url = t.announce;
-            if (url.substr(0, 7) == "http://") url = url.substr(7);
-            
-            size_t slash = url.find('/');
-            std::string hostport = url.substr(0, slash);
-            std::string path = url.substr(slash);
-            std::string port = "80";
-            std::string host = hostport;
+        static std::string RandomBytes(size_t n, uint32_t seed) {
+            std::mt19937 rng(seed);
+            std::string out(n, '\0');
+            for (auto& c : out) c = static_cast<char>(rng());
+            return out;
+        }
 
-            size_t colon = hostport.find(':');
-            if (colon != std::string::npos) {
-                host = hostport.substr(0, colon);
-                port = hostport.substr(colon + 1);
+        // Multi-file torrent: a large pieces blob plus a structure-heavy file list.
+        static std::string SyntheticTorrent(size_t piece_count, size_t file_count) {
+            std::string out = "d8:announce35:http://tracker.example.com/announce4:infod5:filesl";
+            for (size_t i = 0; i < file_count; i++) {
+                std::string name = "file" + std::to_string(i) + ".bin";
+                out += "d6:lengthi" + std::to_string(262144 + i) + "e4:pathl3:dir" + std::to_string(name.size()) + ":" + name + "ee";
             }
+            std::string pieces = RandomBytes(piece_count * PIECE_HASH_LEN, 1);
+            out += "e4:name9:synthetic12:piece lengthi262144e6:pieces" + std::to_string(pieces.size()) + ":" + pieces + "ee";
+            return out;
+        }
 
-            std::string peer_id = Utils::GeneratePeerId();
-            std::vector<uint8_t> pid_vec(peer_id.begin(), peer_id.end());
-
-            std::ostringstream req;
-            req << "GET " << path 
-                << "?info_hash=" << Utils::UrlEncode(t.info_hash_raw)
-                << "&peer_id=" << Utils::UrlEncode(pid_vec)
-                << "&port=6881&uploaded=0&downloaded=0&compact=1"
-                << "&left=" << t.length 
-                << " HTTP/1.0\r\nHost: " << host << "\r\nConnection: close\r\n\r\n";
+        // Non-compact tracker response: one dict per peer.
+        static std::string SyntheticTrackerBody(size_t peer_count) {
+            std::string out = "d8:intervali1800e5:peersl";
+            std::string ids = RandomBytes(peer_count * 20, 2);
+            for (size_t i = 0; i < peer_count; i++) {
+                std::string ip = "10." + std::to_string((i >> 16) & 0xff) + "." + std::to_string((i >> 8) & 0xff) + "." + std::to_string(i & 0xff);
+                out += "d2:ip" + std::to_string(ip.size()) + ":" + ip + "7:peer id20:" + ids.substr(i * 20, 20) + "4:porti" + std::to_string(6881 + i % 1000) + "ee";
+            }
+            return out + "ee";
+        }
 
-            int sock = Network::ConnectHostname(host, port);
-            if (sock < 0) throw std::runtime_error("Tracker connection failed");
+        static int Decode(int argc, char* argv[]) {
+            std::vector<std::pair<std::string, std::string>> inputs;
+            for (int i = 0; i < argc; i++) {
+                std::ifstream in(argv[i], std::ios::binary);
+                if (!in) throw std::runtime_error(std::string("Cannot open file: ") + argv[i]);
+                inputs.emplace_back(argv[i], std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()));
+            }
+            if (inputs.empty()) {
+                inputs.emplace_back("torrent, 200k pieces", SyntheticTorrent(200000, 2000));
+                inputs.emplace_back("torrent, 50k files", SyntheticTorrent(20000, 50000));
+                inputs.emplace_back("tracker, 50k peers", SyntheticTrackerBody(50000));
+            }
 
-            std::string request = req.str();
-            Network::SendAll(sock, request.data(), request.size());
-            
-            std::vector<uint8_t> resp = Network::RecvUntilClosed(sock);
-            close(sock);
+            volatile size_t sink = 0;
+            for (const auto& [label, data] : inputs) {
+                int iterations = static_cast<int>(std::clamp<size_t>(256 * 1024 * 1024 / (data.size() + 1), 3, 1000));
+                if (BEncoder::DecodeView(data, false).NodeCount() != BEncoder::DecodeView(data, true).NodeCount()) {
+                    throw std::runtime_error("Scalar and indexed decoders disagree on " + label);
+                }
+                std::cout << label << " (" << data.size() << " bytes, " << iterations << " runs)\n";
+                Report("json Decode", data.size(), SecondsPerRun(iterations, [&] { sink = sink + BEncoder::Decode(data).size(); }));
+                Report("tape, scalar", data.size(), SecondsPerRun(iterations, [&] { sink = sink + BEncoder::DecodeView(data, false).NodeCount(); }));
+                Report("tape, indexed", data.size(), SecondsPerRun(iterations, [&] { sink = sink + BEncoder::DecodeView(data, true).NodeCount(); }));
+                Report("index pre-pass", data.size(), SecondsPerRun(iterations, [&] { sink = sink + BStructuralIndex::Build(data).size(); }));
+                Report("lazy skip index", data.size(), SecondsPerRun(iterations, [&] { sink = sink + OrThrow(BLazyIndex::Build(data)).ContainerCount(); }));
+            }
+            return 0;
+        }
 
-            std::string resp_str(resp.begin(), resp.end());
-            size_t header_end = resp_str.find("\r\n\r\n");
-            if (header_end == std::string::npos) throw std::runtime_error("Invalid HTTP response");
+        // Downloads a loopback torrent with the blocking single-peer client,
+        // then through the epoll and io_uring loops with every peer at once.
+        static int Loopback(int argc, char* argv[]) {
+            size_t peers = argc > 0 ? std::stoul(argv[0]) : 8;
+            size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 64;
+            LoopbackSwarm swarm(peers, megabytes << 20, 256 * 1024);
+            const TorrentInfo& t = swarm.torrent;
+            std::string output = (std::filesystem::temp_directory_path() / "bench-swarm.bin").string();
+            std::cout << megabytes << " MiB from " << peers << " loopback peers, 256 KiB pieces\n";
+
+            auto verify = [&](const std::string& label) {
+                MappedFile file(output);
+                if (file.View() != swarm.Data()) throw std::runtime_error(label + " download is corrupt");
+            };
+
+            Report("blocking", t.length, SecondsPerRun(1, [&] {
+                std::vector<PeerAddress> found = Client::GetPeers(t);
+                std::vector<uint8_t> pid;
+                bool ext;
+                int sock = Client::PerformHandshake(found.at(0).ip, found[0].port, t, pid, ext);
+                FramedReader peer(sock);
+                OrThrow(Client::WaitForUnchoke(peer));
+                std::ofstream out(output, std::ios::binary | std::ios::trunc);
+                for (int i = 0; i < Client::PieceCount(t); i++) {
+                    std::vector<uint8_t> piece = OrThrow(Client::DownloadPiece(peer, t, i));
+                    out.write(reinterpret_cast<const char*>(piece.data()), piece.size());
+                }
+                close(sock);
+            }));
+            verify("blocking");
 
-            std::string body = resp_str.substr(header_end + 4);
-            json tracker_resp = BEncoder::Decode(body);
-            std::string peers_bin = tracker_resp["peers"].get<std::string>();
+            Report("epoll", t.length, SecondsPerRun(1, [&] {
+                Reactor reactor;
+                Downloader::Run(reactor, t, output, nullptr);
+            }));
+            verify("epoll");
 
-            std::vector<PeerAddress> peers;
-            for (size_t i = 0; i + 6 <= peers_bin.size(); i += 6) {
-                uint8_t a = peers_bin[i];
-                uint8_t b = peers_bin[i+1];
-                uint8_t c = peers_bin[i+2];
-                uint8_t d = peers_bin[i+3];
-                uint16_t p = (static_cast<uint8_t>(peers_bin[i+4]) << 8) | static_cast<uint8_t>(peers_bin[i+5]);
-                
-                std::string ip = std::to_string(a) + "." + std::to_string(b) + "." + std::to_string(c) + "." + std::to_string(d);
-                peers.push_back({ip, p});
+            if (!UringLoop::Available()) {
+                std::cout << "  io_uring            unavailable\n";
+            } else {
+                Report("io_uring", t.length, SecondsPerRun(1, [&] {
+                    UringLoop loop;
+                    Downloader::Run(loop, t, output, nullptr);
+                }));
+                verify("io_uring");
             }
-            return peers;
+            std::filesystem::remove(output);
+            return 0;
         }
 
-        static int PerformHandshake(const std::string& ip, uint16_t port, const TorrentInfo& t, std::vector<uint8_t>& out_peer_id, bool& out_peer_supports_ext, bool support_extensions = false) {
-            int sock = Network::Connect(ip, port);
-            if (sock < 0) throw std::runtime_error("Connection to peer failed");
+        // Downloads a loopback swarm through the epoll loop under each
+        // socket profile. Loopback has next to no latency, so the buffer
+        // sizes only matter once delay is added, e.g. with
+        // `tc qdisc add dev lo root netem delay 25ms`.
+        static int Sockets(int argc, char* argv[]) {
+            size_t peers = argc > 0 ? std::stoul(argv[0]) : 4;
+            size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 64;
+            LoopbackSwarm swarm(peers, megabytes << 20, 256 * 1024);
+            std::string output = (std::filesystem::temp_directory_path() / "bench-sockets.bin").string();
+            std::cout << megabytes << " MiB from " << peers << " loopback peers\n";
+
+            SocketProfile selected = Network::profile;
+            for (std::string_view name : {"kernel", "default", "latency", "bulk"}) {
+                Network::profile = SocketProfile::Named(name);
+                Report(std::string(name), swarm.torrent.length, SecondsPerRun(1, [&] {
+                    Reactor reactor;
+                    Downloader::Run(reactor, swarm.torrent, output, nullptr);
+                }));
+                MappedFile file(output);
+                if (file.View() != swarm.Data()) throw std::runtime_error(std::string(name) + " download is corrupt");
+            }
+            Network::profile = selected;
+            Report("command line", swarm.torrent.length, SecondsPerRun(1, [&] {
+                Reactor reactor;
+                Downloader::Run(reactor, swarm.torrent, output, nullptr);
+            }));
+            std::filesystem::remove(output);
+            return 0;
+        }
 
-            std::vector<uint8_t> handshake;
-            handshake.push_back(19);
-            std::string protocol = "BitTorrent protocol";
-            handshake.insert(handshake.end(), protocol.begin(), protocol.end());
+        // Cost of one tracker host lookup: getaddrinfo on every announce,
+        // the resolver with its cache cleared, and the resolver's cache.
+        // The default host comes from /etc/hosts, so no DNS server is needed.
+        // `dns check` tests the cache's expiry and sharing instead.
+        static int Dns(int argc, char* argv[]) {
+            if (argc > 0 && std::string_view(argv[0]) == "check") return DnsCheck();
+            std::string host = argc > 0 ? argv[0] : "localhost";
+            int count = argc > 1 ? std::stoi(argv[1]) : 2000;
+            std::cout << count << " lookups of " << host << "\n";
+
+            auto report = [&](const std::string& label, double seconds) {
+                std::cout << "  " << std::left << std::setw(18) << label << std::right << std::fixed << std::setprecision(3)
+                          << std::setw(10) << seconds * 1e6 << " us/lookup\n";
+            };
+            report("getaddrinfo", SecondsPerRun(count, [&] {
+                addrinfo hints{}, *res;
+                hints.ai_family = AF_INET;
+                hints.ai_socktype = SOCK_STREAM;
+                if (getaddrinfo(host.c_str(), "80", &hints, &res) != 0) throw std::runtime_error("Cannot resolve " + host);
+                freeaddrinfo(res);
+            }));
+
+            Resolver resolver;
+            report("resolver, cold", SecondsPerRun(count, [&] {
+                resolver.Clear();
+                if (resolver.Resolve(host, "80").get().empty()) throw std::runtime_error("Cannot resolve " + host);
+            }));
+            report("resolver, cached", SecondsPerRun(count, [&] {
+                if (resolver.Resolve(host, "80").get().empty()) throw std::runtime_error("Cannot resolve " + host);
+            }));
+            std::cout << "  " << resolver.Hits() << " cache hits\n";
+            return 0;
+        }
 
-            std::vector<uint8_t> reserved(8, 0);
-            if (support_extensions) {
-                reserved[5] |= 0x10; 
+        // Drives a Resolver with a fake lookup, which counts its calls, and a
+        // clock that only moves when told to. Throws on the first failure.
+        static int DnsCheck() {
+            std::mutex mutex;
+            std::condition_variable released;
+            bool hold = false;
+            std::atomic<int> lookups{0};
+            auto lookup = [&](const std::string& host, const std::string& port) {
+                lookups++;
+                std::unique_lock lock(mutex);
+                released.wait(lock, [&] { return !hold; });
+                return host == "fail" ? Resolver::Addresses() : Resolver::Addresses{*Network::ParseAddress("127.0.0.1", std::stoi(port))};
+            };
+            std::atomic<std::chrono::steady_clock::duration> elapsed{};
+            auto start = std::chrono::steady_clock::now();
+            auto advance = [&](std::chrono::seconds by) { elapsed = elapsed.load() + by; };
+            Resolver resolver(std::chrono::seconds(60), lookup, [&] { return start + elapsed.load(); });
+
+            auto expect = [&](const std::string& label, const std::string& host, int expected) {
+                resolver.Resolve(host, "80").get();
+                if (lookups != expected) throw std::runtime_error(label + ": " + std::to_string(lookups) + " lookups, expected " + std::to_string(expected));
+                std::cout << "  ok  " << label << "\n";
+            };
+            expect("first lookup", "tracker", 1);
+            advance(std::chrono::seconds(59));
+            expect("cached within the TTL", "tracker", 1);
+            advance(std::chrono::seconds(2));
+            expect("looked up again after the TTL", "tracker", 2);
+
+            expect("failed lookup", "fail", 3);
+            advance(Resolver::FAILURE_TTL - std::chrono::seconds(1));
+            expect("failure cached within 10 s", "fail", 3);
+            advance(std::chrono::seconds(2));
+            expect("failure looked up again after 10 s", "fail", 4);
+
+            {
+                std::lock_guard lock(mutex);
+                hold = true;
             }
-            handshake.insert(handshake.end(), reserved.begin(), reserved.end()); 
-            
-            handshake.insert(handshake.end(), t.info_hash_raw.begin(), t.info_hash_raw.end());
-            std::string my_id = Utils::GeneratePeerId();
-            handshake.insert(handshake.end(), my_id.begin(), my_id.end());
+            std::vector<std::shared_future<Resolver::Addresses>> results(8);
+            std::vector<std::thread> callers;
+            for (auto& result : results) callers.emplace_back([&] { result = resolver.Resolve("shared", "80"); });
+            for (std::thread& t : callers) t.join();
+            {
+                std::lock_guard lock(mutex);
+                hold = false;
+            }
+            released.notify_all();
+            for (auto& result : results) {
+                if (result.get().size() != 1) throw std::runtime_error("shared lookup: a caller got no address");
+            }
+            if (lookups != 5) throw std::runtime_error("shared lookup: " + std::to_string(lookups - 4) + " lookups for 8 concurrent callers");
+            std::cout << "  ok  8 concurrent callers share one lookup\n";
+            return 0;
+        }
 
-            Network::SendAll(sock, handshake.data(), handshake.size());
+        static double CpuSeconds() {
+            rusage usage{};
+            getrusage(RUSAGE_SELF, &usage);
+            return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        }
 
-            std::vector<uint8_t> response(HANDSHAKE_LEN);
-            Network::RecvAll(sock, response.data(), HANDSHAKE_LEN);
+        // Achieved rate and CPU time of loopback downloads under each kind of
+        // limit. Throttled transfers should land near their cap while the
+        // process stays mostly idle.
+        static int Shaping(int argc, char* argv[]) {
+            size_t megabytes = argc > 0 ? std::stoul(argv[0]) : 8;
+            const double MB = 1e6;
+            LoopbackSwarm swarm(4, megabytes << 20, 256 * 1024);
+            const TorrentInfo& t = swarm.torrent;
+            std::string output = (std::filesystem::temp_directory_path() / "bench-shaping.bin").string();
+            std::cout << megabytes << " MiB from 4 loopback peers\n";
+
+            auto reset = [] {
+                Bandwidth::Global().upload.SetRate(0);
+                Bandwidth::Global().download.SetRate(0);
+                Bandwidth::SetTorrentRates(0, 0);
+                Bandwidth::SetPeerRates(0, 0);
+            };
+            auto run = [&](const std::string& label, bool blocking, const std::function<void()>& limit, const std::function<void()>& during = nullptr) {
+                reset();
+                limit();
+                double cpu = CpuSeconds();
+                std::thread adjust;
+                double seconds = SecondsPerRun(1, [&] {
+                    if (during) adjust = std::thread(during);
+                    if (!blocking) {
+                        Reactor reactor;
+                        Downloader::Run(reactor, t, output, nullptr);
+                        return;
+                    }
+                    std::vector<PeerAddress> found = Client::GetPeers(t);
+                    std::vector<uint8_t> pid;
+                    bool ext;
+                    int sock = Client::PerformHandshake(found.at(0).ip, found[0].port, t, pid, ext);
+                    FramedReader peer(sock);
+                    peer.Throttle(Bandwidth::Torrent(t.info_hash_str), Bandwidth::Peer(Network::FormatHostPort(found[0].ip, found[0].port)));
+                    OrThrow(Client::WaitForUnchoke(peer));
+                    std::ofstream out(output, std::ios::binary | std::ios::trunc);
+                    for (int i = 0; i < Client::PieceCount(t); i++) {
+                        std::vector<uint8_t> piece = OrThrow(Client::DownloadPiece(peer, t, i));
+                        out.write(reinterpret_cast<const char*>(piece.data()), piece.size());
+                    }
+                    close(sock);
+                });
+                if (adjust.joinable()) adjust.join();
+                cpu = CpuSeconds() - cpu;
+                MappedFile file(output);
+                if (file.View() != swarm.Data()) throw std::runtime_error(label + " download is corrupt");
+                std::cout << "  " << std::left << std::setw(30) << label << std::right << std::fixed << std::setprecision(2)
+                          << std::setw(8) << t.length / seconds / MB << " MB/s" << std::setw(8) << cpu / seconds * 100 << "% CPU\n";
+            };
+
+            run("unlimited", false, [] {});
+            run("global 8 MB/s", false, [&] { Bandwidth::Global().download.SetRate(8 * MB); });
+            run("torrent 6 MB/s", false, [&] { Bandwidth::SetTorrentRates(0, 6 * MB); });
+            run("peer 1 MB/s, 4 peers", false, [&] { Bandwidth::SetPeerRates(0, 1 * MB); });
+            run("blocking, global 8 MB/s", true, [&] { Bandwidth::Global().download.SetRate(8 * MB); });
+            run("seeder upload 6 MB/s", true, [&] { Bandwidth::SetTorrentRates(6 * MB, 0); });
+            // Starts at 4 MB/s and is raised to 16 MB/s once a third of the
+            // data should have arrived: about 8 MB/s overall.
+            double third = t.length / 3.0 / (4 * MB);
+            run("4 then 16 MB/s", false, [&] { Bandwidth::Global().download.SetRate(4 * MB); }, [&] {
+                std::this_thread::sleep_for(std::chrono::duration<double>(third));
+                Bandwidth::Global().download.SetRate(16 * MB);
+            });
+            reset();
+            std::filesystem::remove(output);
+            return 0;
+        }
 
-            out_peer_id.assign(response.begin() + 48, response.end());
+        // Reads `sock` to end-of-file, as a blocking socket without timeouts.
+        static std::string ReadToEnd(int sock) {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+            std::string out;
+            char buf[65536];
+            ssize_t n;
+            while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) out.append(buf, n);
+            close(sock);
+            return out;
+        }
 
-            if ((response[25] & 0x10) != 0) {
-                out_peer_supports_ext = true;
-            } else {
-                out_peer_supports_ext = false;
+        // A bulk transfer between two uTP engines on loopback, each adding
+        // `delay` to and dropping `loss` of the datagrams it sends, next to
+        // TCP on the same loopback. Then one where the sender's delay jumps
+        // mid-transfer, and the peer protocol over uTP: downloads through
+        // each I/O path from seeders that accept only uTP. Throws if data
+        // arrives corrupt, if loss causes no resends, or if the window does
+        // not shrink as delay rises.
+        static int Utp(int argc, char* argv[]) {
+            size_t megabytes = argc > 0 ? std::stoul(argv[0]) : 16;
+            std::chrono::milliseconds delay(argc > 1 ? std::stol(argv[1]) : 10);
+            double loss = argc > 2 ? std::stod(argv[2]) / 100 : 0.01;
+            std::string data = RandomBytes(megabytes << 20, 6);
+            std::cout << megabytes << " MiB over loopback\n";
+
+            auto check = [](const std::string& label, std::string_view received, std::string_view expected) {
+                if (received != expected) throw std::runtime_error(label + " transfer is corrupt");
+            };
+            {
+                int listener = Listen(1);
+                std::string received;
+                Report("tcp", data.size(), SecondsPerRun(1, [&] {
+                    std::thread sender([&] {
+                        int c = accept(listener, nullptr, nullptr);
+                        Network::SendAll(c, data.data(), data.size());
+                        close(c);
+                    });
+                    received = ReadToEnd(Network::Connect("127.0.0.1", PortOf(listener)));
+                    sender.join();
+                }));
+                close(listener);
+                check("tcp", received, data);
+            }
+            SocketAddress local = *Network::ParseAddress("127.0.0.1", 0);
+            // Runs `during` on its own thread while the server sends `data`.
+            auto transfer = [&](const std::string& label, UtpEngine& server, UtpEngine& client, std::function<void()> during) {
+                std::string received;
+                std::thread side;
+                Report(label, data.size(), SecondsPerRun(1, [&] {
+                    std::thread sender([&] {
+                        int c = server.Accept();
+                        Network::SendAll(c, data.data(), data.size());
+                        close(c);
+                    });
+                    if (during) side = std::thread(during);
+                    received = ReadToEnd(client.Connect(*Network::ParseAddress("127.0.0.1", server.Port()), std::chrono::seconds(10), false));
+                    sender.join();
+                }));
+                if (side.joinable()) side.join();
+                check(label, received, data);
+                std::cout << "  " << std::setw(18) << "" << server.stats.sent << " datagrams sent, " << server.stats.resent << " resent, "
+                          << server.stats.dropped + client.stats.dropped << " dropped\n";
+            };
+            auto stream = [&](const std::string& label, UtpEngine::Impairment impairment) {
+                UtpEngine server(local, true, impairment);
+                UtpEngine client(local, false, impairment);
+                transfer(label, server, client, nullptr);
+                if (impairment.loss > 0 && server.stats.resent == 0) throw std::runtime_error(label + ": nothing was resent");
+            };
+            std::string ms = std::to_string(delay.count()) + " ms";
+            std::ostringstream lost;
+            lost << std::setprecision(3) << loss * 100 << "% loss";
+            stream("utp", {});
+            stream("utp, " + ms, {delay, 0});
+            stream("utp, " + lost.str(), {std::chrono::microseconds(0), loss});
+            stream("utp, " + ms + ", " + lost.str(), {delay, loss});
+            {
+                // A constant delay only raises the base delay, so the sender's
+                // delay is raised past the target once its window has grown.
+                UtpEngine server(local, true);
+                UtpEngine client(local, false);
+                size_t peak = 0, after = 0;
+                transfer("utp, delay rising", server, client, [&] {
+                    size_t started = std::min<size_t>(1000, data.size() / UtpEngine::PAYLOAD / 8);
+                    while (server.stats.sent < started) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    server.Impair({std::chrono::milliseconds(250), 0});
+                    // Packets already in flight are still acked quickly, so
+                    // the window may grow before it shrinks.
+                    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+                    while (std::chrono::steady_clock::now() < until) {
+                        peak = std::max<size_t>(peak, server.stats.window);
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                    after = server.stats.window;
+                    server.Impair({});
+                });
+                std::cout << "  " << std::setw(18) << "" << "window peaked at " << peak << " bytes, " << after << " after 2 s at +250 ms\n";
+                if (after >= peak) throw std::runtime_error("utp, delay rising: the window did not shrink");
             }
 
-            return sock;
+            LoopbackSwarm swarm(4, megabytes << 20, 256 * 1024, false, Transport::Utp);
+            const TorrentInfo& t = swarm.torrent;
+            std::string output = (std::filesystem::temp_directory_path() / "bench-utp.bin").string();
+            Transport selected = Network::peer_transport;
+            Network::peer_transport = Transport::Utp;
+            Report("peer wire, blocking", t.length, SecondsPerRun(1, [&] {
+                std::vector<PeerAddress> found = Client::GetPeers(t);
+                std::vector<uint8_t> pid;
+                bool ext;
+                int sock = Client::PerformHandshake(found.at(0).ip, found[0].port, t, pid, ext);
+                FramedReader peer(sock);
+                OrThrow(Client::WaitForUnchoke(peer));
+                std::ofstream out(output, std::ios::binary | std::ios::trunc);
+                for (int i = 0; i < Client::PieceCount(t); i++) {
+                    std::vector<uint8_t> piece = OrThrow(Client::DownloadPiece(peer, t, i));
+                    out.write(reinterpret_cast<const char*>(piece.data()), piece.size());
+                }
+                close(sock);
+            }));
+            check("blocking", MappedFile(output).View(), swarm.Data());
+            Report("peer wire, epoll", t.length, SecondsPerRun(1, [&] {
+                Reactor reactor;
+                Downloader::Run(reactor, t, output, nullptr);
+            }));
+            check("epoll", MappedFile(output).View(), swarm.Data());
+            if (UringLoop::Available()) {
+                Report("peer wire, io_uring", t.length, SecondsPerRun(1, [&] {
+                    UringLoop loop;
+                    Downloader::Run(loop, t, output, nullptr);
+                }));
+                check("io_uring", MappedFile(output).View(), swarm.Data());
+            }
+            Network::peer_transport = selected;
+            std::filesystem::remove(output);
+            return 0;
         }
 
-       
-        static void ReadMessage(int sock, std::vector<uint8_t>& buffer) {
-             uint32_t len;
-             Network::RecvAll(sock, &len, 4);
-             len = ntohl(len);
-             if (len > 0) {
-                 buffer.resize(len);
-                 Network::RecvAll(sock, buffer.data(), len);
-             } else {
-                 buffer.clear(); 
-             }
+        // Keeps the compiler from folding a benchmarked value away.
+        template <typename T>
+        static void Keep(const T& value) {
+            asm volatile("" : : "g"(&value) : "memory");
         }
 
-        static void SendExtensionHandshake(int sock) {
-            json handshake_payload;
-            handshake_payload["m"]["ut_metadata"] = 1;
+        // Nanoseconds to encode and to decode each peer wire message, by its
+        // type and through the Message variant, next to the std::vector
+        // handshake assembly the codec replaced.
+        static int Wire(int argc, char* argv[]) {
+            int iterations = argc > 0 ? std::stoi(argv[0]) : 1000000;
+            std::cout << iterations << " iterations" << std::setw(23) << "encode" << std::setw(14) << "decode" << std::setw(14) << "any\n";
+            auto report = [](const std::string& label, std::initializer_list<std::optional<double>> seconds) {
+                std::cout << "  " << std::left << std::setw(22) << label << std::right << std::fixed << std::setprecision(1);
+                for (std::optional<double> s : seconds) {
+                    if (s) std::cout << std::setw(11) << *s * 1e9 << " ns";
+                    else std::cout << std::setw(14) << "-";
+                }
+                std::cout << "\n";
+            };
+            auto measure = [&]<typename M>(const std::string& label, const M& m) {
+                double encode = SecondsPerRun(iterations, [&] { Keep(PeerWire::Encode(m)); });
+                auto header = PeerWire::Encode(m);
+                std::string msg(reinterpret_cast<const char*>(header.data()) + 4, header.size() - 4);
+                if constexpr (requires { m.payload; }) msg.append(reinterpret_cast<const char*>(m.payload.data()), m.payload.size());
+                double decode = SecondsPerRun(iterations, [&] {
+                    Keep(msg);
+                    Keep(OrThrow(PeerWire::Decode<M>(PeerWire::View(msg))));
+                });
+                double any = SecondsPerRun(iterations, [&] {
+                    Keep(msg);
+                    Keep(OrThrow(PeerWire::Decode(PeerWire::View(msg))));
+                });
+                report(label, {encode, decode, any});
+            };
+
+            std::string block = RandomBytes(BLOCK_SIZE, 7);
+            std::string bits = RandomBytes(128, 8);
+            std::string metadata = "d8:msg_typei0e5:piecei0ee";
+            measure("choke", PeerWire::Choke{});
+            measure("interested", PeerWire::Interested{});
+            measure("have", PeerWire::Have{1234});
+            measure("bitfield, 1024 pieces", PeerWire::Bitfield{PeerWire::View(bits)});
+            measure("request", PeerWire::Request{12, 16384, BLOCK_SIZE});
+            measure("piece", PeerWire::Piece{12, 16384, PeerWire::View(block)});
+            measure("cancel", PeerWire::Cancel{12, 16384, BLOCK_SIZE});
+            measure("port", PeerWire::Port{6881});
+            measure("have all", PeerWire::HaveAll{});
+            measure("reject request", PeerWire::RejectRequest{12, 16384, BLOCK_SIZE});
+            measure("allowed fast", PeerWire::AllowedFast{42});
+            measure("extended", PeerWire::Extended{3, PeerWire::View(metadata)});
+
+            PeerWire::Handshake handshake;
+            handshake.reserved[5] = PeerWire::Handshake::EXTENSION_PROTOCOL;
+            double encode = SecondsPerRun(iterations, [&] { Keep(PeerWire::Encode(handshake)); });
+            auto encoded = PeerWire::Encode(handshake);
+            double decode = SecondsPerRun(iterations, [&] {
+                Keep(encoded);
+                Keep(OrThrow(PeerWire::DecodeHandshake(encoded)));
+            });
+            report("handshake", {encode, decode, std::nullopt});
+            std::string peer_id(20, '0');
+            std::vector<uint8_t> info_hash(20, 1);
+            encode = SecondsPerRun(iterations, [&] {
+                std::vector<uint8_t> out;
+                out.push_back(19);
+                std::string protocol = "BitTorrent protocol";
+                out.insert(out.end(), protocol.begin(), protocol.end());
+                std::vector<uint8_t> reserved(8, 0);
+                reserved[5] |= 0x10;
+                out.insert(out.end(), reserved.begin(), reserved.end());
+                out.insert(out.end(), info_hash.begin(), info_hash.end());
+                out.insert(out.end(), peer_id.begin(), peer_id.end());
+                Keep(out);
+            });
+            report("handshake, std::vector", {encode, std::nullopt, std::nullopt});
+            return 0;
+        }
 
-            std::string bencoded = BEncoder::Encode(handshake_payload);
+        static int Listen(int backlog, const std::string& ip = "127.0.0.1") {
+            SocketAddress addr = *Network::ParseAddress(ip, 0);
+            int fd = socket(addr.storage.ss_family, SOCK_STREAM, 0);
+            if (fd < 0 || bind(fd, addr.Get(), addr.length) < 0 || listen(fd, backlog) < 0) {
+                throw std::runtime_error("Cannot open loopback listener on " + ip);
+            }
+            return fd;
+        }
 
-            uint32_t len = htonl(1 + 1 + bencoded.size());
-            
-            std::vector<uint8_t> msg;
-            msg.resize(4);
-            std::memcpy(msg.data(), &len, 4);
-            msg.push_back(20); 
-            msg.push_back(0); 
-            msg.insert(msg.end(), bencoded.begin(), bencoded.end());
+        // sin_port and sin6_port sit at the same offset.
+        static uint16_t PortOf(int fd) {
+            sockaddr_storage addr{};
+            socklen_t len = sizeof(addr);
+            getsockname(fd, (sockaddr*)&addr, &len);
+            return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+        }
 
-            Network::SendAll(sock, msg.data(), msg.size());
+        // A listener that never answers: its accept queue is filled by
+        // `filler`, so later SYNs are dropped as a firewalled host would.
+        static int Blackhole(const std::string& ip, int& filler) {
+            int fd = Listen(0, ip);
+            filler = Network::ConnectNonBlocking(ip, PortOf(fd));
+            pollfd pfd{filler, POLLOUT, 0};
+            poll(&pfd, 1, 1000);
+            return fd;
         }
 
-        
-        static int ReceiveExtensionHandshake(int sock) {
-            while (true) {
-                std::vector<uint8_t> msg;
-                ReadMessage(sock, msg);
+        // A loopback port with nothing listening, so connects to it are refused.
+        static int Refusing(const std::string& ip) {
+            SocketAddress addr = *Network::ParseAddress(ip, 0);
+            int fd = socket(addr.storage.ss_family, SOCK_STREAM, 0);
+            if (fd < 0 || bind(fd, addr.Get(), addr.length) < 0) throw std::runtime_error("Cannot bind loopback port on " + ip);
+            return fd;
+        }
 
-                if (msg.empty()) continue; 
+        static double FirstConnect(const std::vector<PeerAddress>& peers, Connector::Options options, int live) {
+            auto start = std::chrono::steady_clock::now();
+            Connector connector(peers, options);
+            int sock = connector.Next();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (sock < 0) throw std::runtime_error("No peer connected");
+            close(sock);
+            close(accept(live, nullptr, nullptr));
+            return elapsed.count();
+        }
 
-              
-                if (msg[0] == 20) {
-                    if (msg.size() < 2) continue; 
-                    
-                    if (msg[1] == 0) { 
-                        std::string payload(msg.begin() + 2, msg.end());
-                        json decoded = BEncoder::Decode(payload);
+        static void ReportLatency(const std::string& label, double seconds) {
+            std::cout << "  " << std::left << std::setw(18) << label << std::right << std::fixed << std::setprecision(3)
+                      << std::setw(10) << seconds * 1e3 << " ms\n";
+        }
 
-                        if (decoded.contains("m") && decoded["m"].contains("ut_metadata")) {
-                            return decoded["m"]["ut_metadata"].get<int>();
-                        }
-                        throw std::runtime_error("Peer does not support ut_metadata");
-                    }
-                }
-               
+        // Time to the first connected peer when the tracker lists `dead`
+        // unresponsive peers ahead of a live one, then when a host's IPv6
+        // address is unresponsive and its IPv4 one works. Then staggered
+        // races between ::1 and 127.0.0.1, which throw unless the expected
+        // family wins in the expected time, and finally a download from a
+        // swarm listed in both peers and peers6.
+        static int Connect(int argc, char* argv[]) {
+            size_t dead = argc > 0 ? std::stoul(argv[0]) : 8;
+            std::chrono::milliseconds attempt(argc > 1 ? std::stol(argv[1]) : 500);
+
+            int filler;
+            int blackhole = Blackhole("127.0.0.1", filler);
+            int live = Listen(SOMAXCONN);
+
+            std::vector<PeerAddress> peers(dead, PeerAddress{"127.0.0.1", PortOf(blackhole)});
+            peers.push_back({"127.0.0.1", PortOf(live)});
+            std::cout << dead << " dead peers ahead of 1 live peer, " << attempt.count() << " ms per attempt\n";
+
+            for (size_t parallel : {size_t{1}, Connector::Options{}.parallel}) {
+                Connector::Options options;
+                options.attempt_timeout = attempt;
+                options.overall_timeout = attempt * (dead + 2);
+                options.parallel = parallel;
+                ReportLatency(parallel == 1 ? "sequential" : std::to_string(parallel) + " in parallel", FirstConnect(peers, options, live));
             }
+            close(filler);
+            close(blackhole);
+
+            int filler6;
+            int blackhole6 = Blackhole("::1", filler6);
+            std::vector<PeerAddress> dual = {{"127.0.0.1", PortOf(live)}, {"::1", PortOf(blackhole6)}};
+            std::cout << "::1 unresponsive, 127.0.0.1 live\n";
+            Connector::Options options;
+            options.attempt_timeout = attempt;
+            options.parallel = 1;
+            ReportLatency("IPv6, then IPv4", FirstConnect(dual, options, live));
+            options.parallel = 2;
+            options.stagger = Connector::ATTEMPT_DELAY;
+            ReportLatency("happy eyeballs", FirstConnect(dual, options, live));
+
+            auto race = [&](const std::string& label, const std::vector<PeerAddress>& candidates, int family, std::chrono::milliseconds earliest, std::chrono::milliseconds latest) {
+                Connector::Options options;
+                options.attempt_timeout = attempt;
+                options.stagger = Connector::ATTEMPT_DELAY;
+                auto start = std::chrono::steady_clock::now();
+                Connector connector(candidates, options);
+                SocketAddress which;
+                int sock = connector.Next(&which);
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                if (sock < 0) throw std::runtime_error(label + ": nothing connected");
+                close(sock);
+                ReportLatency(label, std::chrono::duration<double>(elapsed).count());
+                if (which.storage.ss_family != family) throw std::runtime_error(label + ": " + Network::Name(which) + " won the race");
+                if (elapsed < earliest || elapsed > latest) {
+                    throw std::runtime_error(label + ": connected after " + std::to_string(std::chrono::ceil<std::chrono::milliseconds>(elapsed).count()) + " ms");
+                }
+            };
+            int live6 = Listen(SOMAXCONN, "::1");
+            int refusing6 = Refusing("::1");
+            blackhole = Blackhole("127.0.0.1", filler);
+            std::cout << "::1 and 127.0.0.1, " << Connector::ATTEMPT_DELAY.count() << " ms stagger: IPv6 wins unless ::1 fails\n";
+            race("both live", {{"127.0.0.1", PortOf(live)}, {"::1", PortOf(live6)}}, AF_INET6, {}, Connector::ATTEMPT_DELAY);
+            race("IPv4 unresponsive", {{"127.0.0.1", PortOf(blackhole)}, {"::1", PortOf(live6)}}, AF_INET6, {}, Connector::ATTEMPT_DELAY);
+            race("::1 refuses", {{"127.0.0.1", PortOf(live)}, {"::1", PortOf(refusing6)}}, AF_INET, {}, Connector::ATTEMPT_DELAY);
+            race("::1 unresponsive", dual, AF_INET, std::min(Connector::ATTEMPT_DELAY, attempt), 2 * Connector::ATTEMPT_DELAY);
+            close(filler);
+            close(blackhole);
+            close(refusing6);
+            close(live6);
+            close(filler6);
+            close(blackhole6);
+            close(live);
+
+            LoopbackSwarm swarm(4, 16 << 20, 256 * 1024, true);
+            std::string output = (std::filesystem::temp_directory_path() / "bench-dual-stack.bin").string();
+            std::vector<PeerAddress> found = Client::GetPeers(swarm.torrent);
+            size_t v6 = std::count_if(found.begin(), found.end(), [](const PeerAddress& p) { return p.ip.find(':') != std::string::npos; });
+            std::cout << "16 MiB from " << found.size() - v6 << " IPv4 and " << v6 << " IPv6 loopback peers\n";
+            Report("epoll", swarm.torrent.length, SecondsPerRun(1, [&] {
+                Reactor reactor;
+                Downloader::Run(reactor, swarm.torrent, output, nullptr);
+            }));
+            MappedFile file(output);
+            if (file.View() != swarm.Data()) throw std::runtime_error("dual-stack download is corrupt");
+            std::filesystem::remove(output);
+            return 0;
         }
 
-       
-       static void SendMetadataRequest(int sock, int ext_id, int piece_index) {
-            json payload;
-            payload["msg_type"] = 0;
-            payload["piece"] = piece_index;
-            std::string bencoded_payload = BEncoder::Encode(payload);
-
-        
-            uint32_t msg_length = 1 + 1 + bencoded_payload.size();
-            uint32_t len = htonl(msg_length);
-            uint8_t msg_id = 20;
-            uint8_t extension_id = static_cast<uint8_t>(ext_id);
-
-            std::vector<uint8_t> packet;
-            packet.resize(4);
-            std::memcpy(packet.data(), &len, 4);
-            packet.push_back(msg_id);
-            packet.push_back(extension_id);
-            packet.insert(packet.end(), bencoded_payload.begin(), bencoded_payload.end());
-
-            Network::SendAll(sock, packet.data(), packet.size());
+        // Writes back any dirty pages and drops `path` from the page cache, so
+        // the next load has to go to the disk.
+        static void Evict(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) throw std::runtime_error("Cannot open file: " + path);
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
         }
 
-        
-       static std::vector<uint8_t> ReceiveMetadataResponse(int sock, int ext_id) {
-            while (true) {
-                uint32_t len;
-            
-            
-                ssize_t n = recv(sock, &len, 4, 0);
-                
-                
-                if (n == 0) {
-                    throw std::runtime_error("Peer closed connection");
-                }
-                if (n < 0) {
-                    throw std::runtime_error("recv() error");
-                }
-                if (n < 4) {
-                
-                    size_t received = n;
-                    while (received < 4) {
-                        n = recv(sock, ((char*)&len) + received, 4 - received, 0);
-                        if (n <= 0) throw std::runtime_error("Connection closed during length read");
-                        received += n;
-                    }
-                }
-                
-                len = ntohl(len);
-                
-                
-                if (len == 0) {
-                
-                    continue;
-                }
-                
-                if (len > 1000000) {
-                    throw std::runtime_error("Message too large");
-                }
-                
-                std::vector<uint8_t> msg(len);
-                Network::RecvAll(sock, msg.data(), len);
-                
-            
-                uint8_t msg_id = msg[0];
-                if (msg_id != 20) {
-                
-                    continue;
-                }
-                
-                if (msg.size() < 2) continue;
-                
-                uint8_t received_ext_id = msg[1];
-            
-                if (received_ext_id != ext_id) continue;
-                
-                std::string payload_str(msg.begin() + 2, msg.end());
-                
-                int dict_end_pos = 0;
-                json dict = BEncoder::Decode(payload_str, dict_end_pos);
-                
-                
-                
-                if (!dict.contains("msg_type")) continue;
-                
-                int msg_type = dict["msg_type"].get<int>();
-            
-                
-                if (msg_type == 1) {
-                    std::vector<uint8_t> metadata;
-                    size_t raw_data_start = 2 + dict_end_pos;
-                    if (raw_data_start < msg.size()) {
-                        metadata.assign(msg.begin() + raw_data_start, msg.end());
+        // LoadTorrent on a .torrent file against its compiled form, from a
+        // cold page cache and a warm one.
+        static int Startup(int argc, char* argv[]) {
+            std::vector<size_t> piece_counts;
+            for (int i = 0; i < argc; i++) piece_counts.push_back(std::stoul(argv[i]));
+            if (piece_counts.empty()) piece_counts = {100000, 1000000};
+
+            auto dir = std::filesystem::temp_directory_path();
+            for (size_t pieces : piece_counts) {
+                std::string torrent_path = (dir / ("bench-" + std::to_string(pieces) + ".torrent")).string();
+                std::string compiled_path = torrent_path + ".bin";
+                std::string hashes = RandomBytes(pieces * PIECE_HASH_LEN, 4);
+                std::string torrent = "d8:announce35:http://tracker.example.com/announce4:infod6:lengthi" + std::to_string(pieces * 262144) +
+                                      "e4:name9:synthetic12:piece lengthi262144e6:pieces" + std::to_string(hashes.size()) + ":" + hashes + "ee";
+                std::ofstream(torrent_path, std::ios::binary).write(torrent.data(), torrent.size());
+                CompiledTorrent::Write(Client::LoadTorrent(torrent_path), compiled_path);
+
+                int iterations = 5;
+                volatile size_t sink = 0;
+                std::cout << pieces << " pieces (" << torrent.size() << " byte .torrent, " << iterations << " runs)\n";
+                for (const auto& [label, path] : {std::pair{".torrent", torrent_path}, std::pair{"compiled", compiled_path}}) {
+                    double cold = 0;
+                    for (int i = 0; i < iterations; i++) {
+                        Evict(path);
+                        cold += SecondsPerRun(1, [&] { sink = sink + Client::LoadTorrent(path).info_hash_raw[0]; });
                     }
-                    return metadata;
-                } else if (msg_type == 2) {
-                    throw std::runtime_error("Peer rejected metadata request");
+                    Report(std::string(label) + ", cold", torrent.size(), cold / iterations);
+                    Report(std::string(label) + ", warm", torrent.size(), SecondsPerRun(iterations, [&] { sink = sink + Client::LoadTorrent(path).info_hash_raw[0]; }));
                 }
+                std::filesystem::remove(torrent_path);
+                std::filesystem::remove(compiled_path);
             }
+            return 0;
         }
 
-       
-        static void WaitForUnchoke(int sock) {
-            uint32_t len = htonl(1);
-            uint8_t id = 2; 
-            Network::SendAll(sock, &len, 4);
-            Network::SendAll(sock, &id, 1);
-
-            while (true) {
-                uint32_t msg_len;
-                Network::RecvAll(sock, &msg_len, 4);
-                msg_len = ntohl(msg_len);
-                if (msg_len == 0) continue;
-
-                uint8_t msg_id;
-                Network::RecvAll(sock, &msg_id, 1);
-
-                if (msg_id == 1) return; 
-
-                std::vector<uint8_t> ignore(msg_len - 1);
-                Network::RecvAll(sock, ignore.data(), msg_len - 1);
+        // What a hostile peer sends: extension messages whose payloads are
+        // valid bencode with a few bytes flipped, cut short, or pure noise.
+        static std::vector<std::string> GarbagePayloads(size_t count) {
+            std::mt19937 rng(3);
+            std::string valid = "d8:msg_typei1e5:piecei0e10:total_sizei34256e1:md11:ut_metadatai3eee";
+            std::vector<std::string> out;
+            out.reserve(count);
+            for (size_t i = 0; i < count; i++) {
+                std::string p = valid;
+                switch (i % 3) {
+                    case 0:
+                        for (int k = 0; k < 3; k++) p[rng() % p.size()] = static_cast<char>(rng());
+                        break;
+                    case 1:
+                        p.resize(rng() % p.size());
+                        break;
+                    default:
+                        p = RandomBytes(16 + rng() % 240, static_cast<uint32_t>(i));
+                }
+                out.push_back(std::move(p));
             }
+            return out;
         }
 
-        static std::vector<uint8_t> DownloadPiece(int sock, const TorrentInfo& t, int piece_idx) {
-            long long total_pieces = (t.length + t.piece_length - 1) / t.piece_length;
-            long long current_piece_size = t.piece_length;
-            if (piece_idx == total_pieces - 1) {
-                long long rem = t.length % t.piece_length;
-                if (rem != 0) current_piece_size = rem;
-            }
-
-            int block_count = (current_piece_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        static void ReportRate(const std::string& label, size_t messages, size_t errors, double seconds) {
+            std::cout << "  " << std::left << std::setw(26) << label << std::right << std::fixed << std::setprecision(0)
+                      << std::setw(12) << messages / seconds << " msgs/s  (" << errors << " rejected)\n";
+        }
 
-            for (int i = 0; i < block_count; i++) {
-                int begin = i * BLOCK_SIZE;
-                int len = BLOCK_SIZE;
-                if (begin + len > current_piece_size) len = current_piece_size - begin;
+        // Reads `count` messages off a socket the way DownloadPiece does:
+        // length, id, piece header and payload as separate reads.
+        static void ReadFramed(const std::string& label, const std::string& stream, size_t count, size_t capacity) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) throw std::runtime_error("socketpair failed");
+            std::thread writer([&] {
+                Network::SendAll(fds[1], stream.data(), stream.size());
+                close(fds[1]);
+            });
+            FramedReader reader(fds[0], capacity);
+            std::vector<uint8_t> block(BLOCK_SIZE);
+            double seconds = SecondsPerRun(1, [&] {
+                for (size_t i = 0; i < count; i++) {
+                    uint32_t len = OrThrow(Client::ReadLength(reader));
+                    uint8_t id;
+                    OrThrow(reader.Read(&id, 1));
+                    if (id == 7) {
+                        uint32_t header[2];
+                        OrThrow(reader.Read(header, 8));
+                        OrThrow(reader.Read(block.data(), len - 9));
+                    } else {
+                        OrThrow(reader.Discard(len - 1));
+                    }
+                }
+            });
+            writer.join();
+            close(fds[0]);
+            std::cout << "  " << std::left << std::setw(26) << label << std::right << std::fixed << std::setprecision(0)
+                      << std::setw(12) << count / seconds << " msgs/s" << std::setprecision(4) << std::setw(10)
+                      << static_cast<double>(reader.Receives()) / count << " recv/msg\n";
+        }
 
-                uint32_t msg_len = htonl(13);
-                uint8_t id = 6; 
-                uint32_t idx = htonl(piece_idx);
-                uint32_t b = htonl(begin);
-                uint32_t l = htonl(len);
+        // Sends `count` request messages in pieces of 16, each as its own
+        // send or queued and flushed once per piece.
+        static void WriteRequests(const std::string& label, size_t count, bool batched) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) throw std::runtime_error("socketpair failed");
+            std::thread drain([&] {
+                char buf[65536];
+                while (recv(fds[1], buf, sizeof(buf), 0) > 0) {}
+            });
+            FramedWriter writer(fds[0]);
+            size_t sends = 0;
+            double seconds = SecondsPerRun(1, [&] {
+                for (size_t i = 0; i < count; i++) {
+                    auto request = PeerWire::Encode(PeerWire::Request{static_cast<uint32_t>(i / 16), static_cast<uint32_t>(i % 16 * BLOCK_SIZE), BLOCK_SIZE});
+                    if (!batched) {
+                        Network::SendAll(fds[0], request.data(), request.size());
+                        sends++;
+                        continue;
+                    }
+                    writer.Push(request.data(), request.size());
+                    if (i % 16 == 15) OrThrow(writer.Flush());
+                }
+                if (!writer.Empty()) OrThrow(writer.Flush());
+            });
+            if (batched) sends = writer.Sends();
+            shutdown(fds[0], SHUT_WR);
+            drain.join();
+            close(fds[0]);
+            close(fds[1]);
+            std::cout << "  " << std::left << std::setw(26) << label << std::right << std::fixed << std::setprecision(0)
+                      << std::setw(12) << count / seconds << " msgs/s" << std::setprecision(4) << std::setw(10)
+                      << static_cast<double>(sends) / count << " send/msg\n";
+        }
 
-                uint8_t req_buf[17];
-                std::memcpy(req_buf, &msg_len, 4);
-                std::memcpy(req_buf + 4, &id, 1);
-                std::memcpy(req_buf + 5, &idx, 4);
-                std::memcpy(req_buf + 9, &b, 4);
-                std::memcpy(req_buf + 13, &l, 4);
+        // Messages per second and syscalls per message: reading every field
+        // straight from the socket and through a FramedReader, then sending
+        // requests one at a time and through a FramedWriter.
+        static int Framing(int argc, char* argv[]) {
+            size_t count = argc > 0 ? std::stoul(argv[0]) : 100000;
 
-                Network::SendAll(sock, req_buf, 17);
+            std::string haves;
+            for (size_t i = 0; i < count; i++) {
+                auto have = PeerWire::Encode(PeerWire::Have{static_cast<uint32_t>(i)});
+                haves.append(have.begin(), have.end());
             }
-            
-            std::vector<uint8_t> piece_data(current_piece_size);
-            long long downloaded = 0;
 
-            while (downloaded < current_piece_size) {
-                uint32_t msg_len;
-                Network::RecvAll(sock, &msg_len, 4);
-                msg_len = ntohl(msg_len);
+            size_t blocks = std::max<size_t>(count / 16, 1);
+            std::string payload = RandomBytes(BLOCK_SIZE, 4);
+            std::string pieces;
+            for (size_t i = 0; i < blocks; i++) {
+                auto header = PeerWire::Encode(PeerWire::Piece{static_cast<uint32_t>(i / 16), static_cast<uint32_t>(i % 16 * BLOCK_SIZE), PeerWire::View(payload)});
+                pieces.append(header.begin(), header.end());
+                pieces += payload;
+            }
 
-                if (msg_len == 0) continue; 
+            std::cout << count << " have messages, " << blocks << " piece blocks of " << BLOCK_SIZE << " bytes\n";
+            ReadFramed("have, unbuffered", haves, count, 0);
+            ReadFramed("have, buffered", haves, count, FramedReader::CAPACITY);
+            ReadFramed("piece, unbuffered", pieces, blocks, 0);
+            ReadFramed("piece, buffered", pieces, blocks, FramedReader::CAPACITY);
+            WriteRequests("request, one send each", count, false);
+            WriteRequests("request, batched", count, true);
+            return 0;
+        }
 
-                uint8_t msg_id;
-                Network::RecvAll(sock, &msg_id, 1);
-
-                if (msg_id == 7) { 
-                    uint32_t idx, begin;
-                    Network::RecvAll(sock, &idx, 4);
-                    Network::RecvAll(sock, &begin, 4);
-                    idx = ntohl(idx);
-                    begin = ntohl(begin);
-
-                    int data_len = msg_len - 9; 
-                    std::vector<uint8_t> block(data_len);
-                    Network::RecvAll(sock, block.data(), data_len);
-
-                    if (begin + data_len <= current_piece_size) {
-                        std::memcpy(piece_data.data() + begin, block.data(), data_len);
-                        downloaded += data_len;
+        // Decodes garbage in memory and then off a socket, once reporting
+        // failures as values and once by throwing and catching them.
+        static int Garbage(int argc, char* argv[]) {
+            size_t count = argc > 0 ? std::stoul(argv[0]) : 200000;
+            std::vector<std::string> payloads = GarbagePayloads(count);
+
+            size_t errors = 0;
+            double seconds = SecondsPerRun(1, [&] {
+                for (const auto& p : payloads) {
+                    size_t pos = 0;
+                    if (!BEncoder::TryDecodeView(p, pos)) errors++;
+                }
+            });
+            ReportRate("decode, expected", count, errors, seconds);
+
+            errors = 0;
+            seconds = SecondsPerRun(1, [&] {
+                for (const auto& p : payloads) {
+                    try {
+                        BEncoder::DecodeView(p);
+                    } catch (const std::exception&) {
+                        errors++;
                     }
-                } else {
-                    std::vector<uint8_t> ignore(msg_len - 1);
-                    Network::RecvAll(sock, ignore.data(), msg_len - 1);
                 }
+            });
+            ReportRate("decode, exceptions", count, errors, seconds);
+
+            std::string stream;
+            for (const auto& p : payloads) {
+                auto header = PeerWire::Encode(PeerWire::Extended{0, PeerWire::View(p)});
+                stream.append(header.begin(), header.end());
+                stream += p;
             }
 
-            std::vector<uint8_t> hash = Utils::CalculateSHA1(piece_data);
-            std::string expected_hash_str = t.pieces.substr(piece_idx * 20, 20);
-            
-            for(int i=0; i<20; i++) {
-                if(hash[i] != (unsigned char)expected_hash_str[i]) 
-                    throw std::runtime_error("Piece hash mismatch");
+            for (bool use_exceptions : {false, true}) {
+                int fds[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) throw std::runtime_error("socketpair failed");
+                std::thread writer([&] {
+                    Network::SendAll(fds[1], stream.data(), stream.size());
+                    close(fds[1]);
+                });
+                errors = 0;
+                FramedReader reader(fds[0]);
+                std::vector<uint8_t> msg;
+                seconds = SecondsPerRun(1, [&] {
+                    for (size_t i = 0; i < count; i++) {
+                        std::string_view payload;
+                        if (use_exceptions) {
+                            try {
+                                OrThrow(Client::ReadMessage(reader, msg));
+                                payload = std::string_view(reinterpret_cast<const char*>(msg.data()) + 2, msg.size() - 2);
+                                BEncoder::DecodeView(payload);
+                            } catch (const std::exception&) {
+                                errors++;
+                            }
+                        } else {
+                            if (!Client::ReadMessage(reader, msg)) break;
+                            payload = std::string_view(reinterpret_cast<const char*>(msg.data()) + 2, msg.size() - 2);
+                            size_t pos = 0;
+                            if (!BEncoder::TryDecodeView(payload, pos)) errors++;
+                        }
+                    }
+                });
+                writer.join();
+                close(fds[0]);
+                ReportRate(use_exceptions ? "socket, exceptions" : "socket, expected", count, errors, seconds);
             }
-
-            return piece_data;
+            return 0;
         }
     };
 }
@@ -649,17 +6013,87 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    // `--name=value` options may appear anywhere; the remaining arguments
+    // keep their relative positions.
+    std::map<std::string, std::string, std::less<>> options;
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.starts_with("--") && eq != std::string_view::npos) options.emplace(arg.substr(2, eq - 2), arg.substr(eq + 1));
+        else argv[kept++] = argv[i];
+    }
+    argc = kept;
+    auto option = [&](std::string_view name, std::string fallback) {
+        auto it = options.find(name);
+        return it == options.end() ? fallback : it->second;
+    };
+
     std::string cmd = argv[1];
 
     try {
+        std::string transport = option("transport", "tcp");
+        if (transport != "tcp" && transport != "utp") throw std::runtime_error("Unknown transport: " + transport);
+        BitTorrent::Network::peer_transport = transport == "utp" ? BitTorrent::Transport::Utp : BitTorrent::Transport::Tcp;
+
+        BitTorrent::Connector::Options connect_options;
+        connect_options.attempt_timeout = std::chrono::milliseconds(std::stol(option("connect-timeout", "3000")));
+        connect_options.overall_timeout = std::chrono::milliseconds(std::stol(option("connect-deadline", "15000")));
+        connect_options.parallel = std::stoul(option("connect-parallel", "32"));
+
+        BitTorrent::SocketProfile& profile = BitTorrent::Network::profile;
+        profile = BitTorrent::SocketProfile::Named(option("socket-profile", "default"));
+        if (options.contains("bandwidth") || options.contains("rtt")) {
+            profile.receive_buffer = profile.send_buffer =
+                BitTorrent::SocketProfile::BdpBytes(std::stod(option("bandwidth", "1000")), std::stod(option("rtt", "100")));
+        }
+        if (options.contains("quickack")) profile.quick_ack = option("quickack", "0") != "0";
+        if (options.contains("notsent-lowat")) profile.notsent_lowat = std::stoi(option("notsent-lowat", "0"));
+
+        // Rate limits are given in KiB/s; 0 is unlimited.
+        auto rate = [&](std::string_view name) { return std::stod(option(name, "0")) * 1024; };
+        BitTorrent::Bandwidth::Global().upload.SetRate(rate("upload-limit"));
+        BitTorrent::Bandwidth::Global().download.SetRate(rate("download-limit"));
+        BitTorrent::Bandwidth::SetTorrentRates(rate("torrent-upload-limit"), rate("torrent-download-limit"));
+        BitTorrent::Bandwidth::SetPeerRates(rate("peer-upload-limit"), rate("peer-download-limit"));
+
         if (cmd == "decode") {
             if (argc < 3) return 1;
-            json j = BitTorrent::BEncoder::Decode(argv[2]);
-            std::cout << j.dump() << std::endl;
+            // `decode <bencode>`, `decode --file <path>`, or `decode -` for stdin.
+            std::string arg = argv[2];
+            if (arg != "-" && arg != "--file") {
+                std::ostringstream rendered;
+                BitTorrent::BJsonWriter writer(rendered);
+                if (!BitTorrent::OrThrow(writer.Feed(arg))) {
+                    throw std::runtime_error(BitTorrent::Error{BitTorrent::Errc::Malformed, "unexpected end of data"}.Message());
+                }
+                std::cout << rendered.str() << std::endl;
+                return 0;
+            }
+            if (arg == "--file" && argc < 4) return 1;
+            int fd = arg == "-" ? STDIN_FILENO : open(argv[3], O_RDONLY | O_CLOEXEC);
+            if (fd < 0) throw std::runtime_error(std::string("Cannot open file: ") + argv[3]);
+            // Output goes straight to stdout as it is produced, so on error the
+            // partial rendering is terminated before the message.
+            BitTorrent::BJsonWriter writer(std::cout);
+            BitTorrent::Result<bool> fed = false;
+            std::vector<char> buf(64 * 1024);
+            ssize_t n;
+            while (fed && !*fed && (n = read(fd, buf.data(), buf.size())) > 0) {
+                fed = writer.Feed(std::string_view(buf.data(), n));
+            }
+            if (fd != STDIN_FILENO) close(fd);
+            if (fed && !*fed) fed = std::unexpected(BitTorrent::Error{BitTorrent::Errc::Malformed, "unexpected end of data"});
+            if (!fed) {
+                std::cout << std::endl;
+                throw std::runtime_error(fed.error().Message());
+            }
+            std::cout << std::endl;
         } 
-        else if (cmd == "info") {
+        else if (cmd == "info" || cmd == "load") {
             if (argc < 3) return 1;
-            auto t = BitTorrent::Client::LoadTorrent(argv[2]);
+            auto t = cmd == "load" ? BitTorrent::CompiledTorrent::Load(std::make_shared<BitTorrent::MappedFile>(argv[2]))
+                                   : BitTorrent::Client::LoadTorrent(argv[2]);
             std::cout << "Tracker URL: " << t.announce << "\n";
             std::cout << "Length: " << t.length << "\n";
             std::cout << "Info Hash: " << t.info_hash_str << "\n";
@@ -674,16 +6108,15 @@ int main(int argc, char* argv[]) {
             auto t = BitTorrent::Client::LoadTorrent(argv[2]);
             auto peers = BitTorrent::Client::GetPeers(t);
             for (const auto& p : peers) {
-                std::cout << p.ip << ":" << p.port << "\n";
+                std::cout << BitTorrent::Network::FormatHostPort(p.ip, p.port) << "\n";
             }
         } 
         else if (cmd == "handshake") {
             if (argc < 4) return 1;
             auto t = BitTorrent::Client::LoadTorrent(argv[2]);
             std::string peer_str = argv[3];
-            size_t colon = peer_str.find(':');
-            std::string ip = peer_str.substr(0, colon);
-            uint16_t port = std::stoi(peer_str.substr(colon + 1));
+            auto [ip, port_str] = BitTorrent::Network::SplitHostPort(peer_str);
+            uint16_t port = std::stoi(port_str);
             
             std::vector<uint8_t> peer_id;
             bool supports_ext;
@@ -705,8 +6138,10 @@ int main(int argc, char* argv[]) {
             std::vector<uint8_t> pid;
             bool supports_ext;
             int sock = BitTorrent::Client::PerformHandshake(peers[0].ip, peers[0].port, t, pid, supports_ext);
-            BitTorrent::Client::WaitForUnchoke(sock);
-            auto data = BitTorrent::Client::DownloadPiece(sock, t, idx);
+            BitTorrent::FramedReader peer(sock);
+            peer.Throttle(BitTorrent::Bandwidth::Torrent(t.info_hash_str), BitTorrent::Bandwidth::Peer(BitTorrent::Network::FormatHostPort(peers[0].ip, peers[0].port)));
+            BitTorrent::OrThrow(BitTorrent::Client::WaitForUnchoke(peer));
+            auto data = BitTorrent::OrThrow(BitTorrent::Client::DownloadPiece(peer, t, idx));
             close(sock);
 
             std::ofstream out(output, std::ios::binary);
@@ -719,19 +6154,36 @@ int main(int argc, char* argv[]) {
             std::string torrent = argv[4];
 
             auto t = BitTorrent::Client::LoadTorrent(torrent);
+            std::string io = option("io", "blocking");
+            if (io == "uring" && !BitTorrent::UringLoop::Available()) {
+                std::cerr << "io_uring is unavailable, using epoll\n";
+                io = "epoll";
+            }
+            if (io == "epoll" || io == "uring") {
+                std::unique_ptr<BitTorrent::IoLoop> loop;
+                if (io == "uring") loop = std::make_unique<BitTorrent::UringLoop>();
+                else loop = std::make_unique<BitTorrent::Reactor>();
+                BitTorrent::Downloader::Run(*loop, t, output, [](int piece) { std::cout << "Downloaded piece " << piece << "\n"; });
+                std::cout << "Download complete\n";
+                return 0;
+            }
+            if (io != "blocking") throw std::runtime_error("Unknown I/O backend: " + io);
+
             auto peers = BitTorrent::Client::GetPeers(t);
             if (peers.empty()) return 1;
 
             std::vector<uint8_t> pid;
             bool supports_ext;
             int sock = BitTorrent::Client::PerformHandshake(peers[0].ip, peers[0].port, t, pid, supports_ext);
-            BitTorrent::Client::WaitForUnchoke(sock);
+            BitTorrent::FramedReader peer(sock);
+            peer.Throttle(BitTorrent::Bandwidth::Torrent(t.info_hash_str), BitTorrent::Bandwidth::Peer(BitTorrent::Network::FormatHostPort(peers[0].ip, peers[0].port)));
+            BitTorrent::OrThrow(BitTorrent::Client::WaitForUnchoke(peer));
 
             std::ofstream out(output, std::ios::binary);
             int total = (t.length + t.piece_length - 1) / t.piece_length;
             
             for (int i = 0; i < total; i++) {
-                auto data = BitTorrent::Client::DownloadPiece(sock, t, i);
+                auto data = BitTorrent::OrThrow(BitTorrent::Client::DownloadPiece(peer, t, i));
                 out.write((char*)data.data(), data.size());
                 std::cout << "Downloaded piece " << i << "\n";
             }
@@ -828,12 +6280,13 @@ int main(int argc, char* argv[]) {
             bool peer_supports_ext = false;
             
             int sock = BitTorrent::Client::PerformHandshake(peers[0].ip, peers[0].port, t, peer_id, peer_supports_ext, true);
+            BitTorrent::FramedReader peer(sock);
             
             std::cout << "Peer ID: " << BitTorrent::Utils::ToHex(peer_id.data(), 20) << "\n";
 
             if (peer_supports_ext) {
                 BitTorrent::Client::SendExtensionHandshake(sock);
-                int ext_id = BitTorrent::Client::ReceiveExtensionHandshake(sock);
+                int ext_id = BitTorrent::OrThrow(BitTorrent::Client::ReceiveExtensionHandshake(peer));
                 std::cout << "Peer Metadata Extension ID: " << ext_id << "\n";
             }
 
@@ -891,13 +6344,16 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
 
-            for (const auto& peer : peers) {
-                int sock = -1;
+            BitTorrent::Connector connector(peers, connect_options);
+            while (true) {
+                int sock = connector.Next();
+                if (sock < 0) break;
                 try {
                     std::vector<uint8_t> peer_id;
                     bool peer_supports_ext = false;
                     
-                    sock = BitTorrent::Client::PerformHandshake(peer.ip, peer.port, t, peer_id, peer_supports_ext, true);
+                    BitTorrent::Client::Handshake(sock, t, peer_id, peer_supports_ext, true);
+                    BitTorrent::FramedReader peer(sock);
                     
                     if (!peer_supports_ext) {
                         close(sock);
@@ -905,22 +6361,22 @@ int main(int argc, char* argv[]) {
                     }
 
                     BitTorrent::Client::SendExtensionHandshake(sock);
-                    int peer_ext_id = BitTorrent::Client::ReceiveExtensionHandshake(sock);
+                    int peer_ext_id = BitTorrent::OrThrow(BitTorrent::Client::ReceiveExtensionHandshake(peer));
                 
                     BitTorrent::Client::SendMetadataRequest(sock, peer_ext_id, 0);
                     
                 
-                    std::vector<uint8_t> metadata_raw = BitTorrent::Client::ReceiveMetadataResponse(sock, 1);
+                    std::vector<uint8_t> metadata_raw = BitTorrent::OrThrow(BitTorrent::Client::ReceiveMetadataResponse(peer, 1));
                     
-                    std::string metadata_str(metadata_raw.begin(), metadata_raw.end());
-                    json info = BitTorrent::BEncoder::Decode(metadata_str);
+                    std::string_view metadata_str(reinterpret_cast<const char*>(metadata_raw.data()), metadata_raw.size());
+                    BitTorrent::InfoDict info = BitTorrent::OrThrow(BitTorrent::BBinder::Decode<BitTorrent::InfoDict>(metadata_str));
                     
-                    std::cout << "Length: " << info["length"] << "\n";
+                    std::cout << "Length: " << info.length << "\n";
                     std::cout << "Info Hash: " << info_hash_hex << "\n";
-                    std::cout << "Piece Length: " << info["piece length"] << "\n";
+                    std::cout << "Piece Length: " << info.piece_length << "\n";
                     std::cout << "Piece Hashes:\n";
                     
-                    std::string pieces = info["pieces"].get<std::string>();
+                    std::string_view pieces = info.pieces;
                     for (size_t i = 0; i < pieces.size(); i += 20) {
                         std::cout << BitTorrent::Utils::ToHex((const unsigned char*)pieces.data() + i, 20) << "\n";
                     }
@@ -929,7 +6385,7 @@ int main(int argc, char* argv[]) {
                     return 0;
                     
                 } catch (const std::exception& e) {
-                    if (sock >= 0) close(sock);
+                    close(sock);
                     continue;
                 }
             }
@@ -989,13 +6445,17 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
 
-            for (const auto& peer : peers) {
-                int sock = -1;
+            BitTorrent::Connector connector(peers, connect_options);
+            while (true) {
+                BitTorrent::SocketAddress address;
+                int sock = connector.Next(&address);
+                if (sock < 0) break;
                 try {
                     std::vector<uint8_t> peer_id;
                     bool peer_supports_ext = false;
                     
-                    sock = BitTorrent::Client::PerformHandshake(peer.ip, peer.port, t, peer_id, peer_supports_ext, true);
+                    BitTorrent::Client::Handshake(sock, t, peer_id, peer_supports_ext, true);
+                    BitTorrent::FramedReader peer(sock);
                     
                     if (!peer_supports_ext) {
                         close(sock);
@@ -1003,26 +6463,28 @@ int main(int argc, char* argv[]) {
                     }
 
                     BitTorrent::Client::SendExtensionHandshake(sock);
-                    int peer_ext_id = BitTorrent::Client::ReceiveExtensionHandshake(sock);
+                    int peer_ext_id = BitTorrent::OrThrow(BitTorrent::Client::ReceiveExtensionHandshake(peer));
                 
                     BitTorrent::Client::SendMetadataRequest(sock, peer_ext_id, 0);
                     
-                    std::vector<uint8_t> metadata_raw = BitTorrent::Client::ReceiveMetadataResponse(sock, 1);
+                    auto metadata_raw = std::make_shared<std::vector<uint8_t>>(BitTorrent::OrThrow(BitTorrent::Client::ReceiveMetadataResponse(peer, 1)));
                     
-                    std::string metadata_str(metadata_raw.begin(), metadata_raw.end());
-                    json info = BitTorrent::BEncoder::Decode(metadata_str);
+                    std::string_view metadata_str(reinterpret_cast<const char*>(metadata_raw->data()), metadata_raw->size());
+                    BitTorrent::InfoDict info = BitTorrent::OrThrow(BitTorrent::BBinder::Decode<BitTorrent::InfoDict>(metadata_str));
                     
-                    t.length = info["length"].get<long long>();
-                    t.piece_length = info["piece length"].get<long long>();
-                    t.pieces = info["pieces"].get<std::string>();
-                    if (info.contains("name")) {
-                        t.name = info["name"].get<std::string>();
+                    t.storage = metadata_raw;
+                    t.length = info.length;
+                    t.piece_length = info.piece_length;
+                    t.pieces = info.pieces;
+                    if (info.name) {
+                        t.name = *info.name;
                     }
                     t.info_hash_str = info_hash_hex;
+                    peer.Throttle(BitTorrent::Bandwidth::Torrent(t.info_hash_str), BitTorrent::Bandwidth::Peer(BitTorrent::Network::Name(address)));
 
-                    BitTorrent::Client::WaitForUnchoke(sock);
+                    BitTorrent::OrThrow(BitTorrent::Client::WaitForUnchoke(peer));
                     
-                    auto data = BitTorrent::Client::DownloadPiece(sock, t, idx);
+                    auto data = BitTorrent::OrThrow(BitTorrent::Client::DownloadPiece(peer, t, idx));
                     
                     std::ofstream out(output, std::ios::binary);
                     out.write((char*)data.data(), data.size());
@@ -1032,7 +6494,7 @@ int main(int argc, char* argv[]) {
                     return 0;
                     
                 } catch (const std::exception& e) {
-                    if (sock >= 0) close(sock);
+                    close(sock);
                     continue;
                 }
             }
@@ -1090,13 +6552,17 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
 
-            for (const auto& peer : peers) {
-                int sock = -1;
+            BitTorrent::Connector connector(peers, connect_options);
+            while (true) {
+                BitTorrent::SocketAddress address;
+                int sock = connector.Next(&address);
+                if (sock < 0) break;
                 try {
                     std::vector<uint8_t> peer_id;
                     bool peer_supports_ext = false;
                     
-                    sock = BitTorrent::Client::PerformHandshake(peer.ip, peer.port, t, peer_id, peer_supports_ext, true);
+                    BitTorrent::Client::Handshake(sock, t, peer_id, peer_supports_ext, true);
+                    BitTorrent::FramedReader peer(sock);
                     
                     if (!peer_supports_ext) {
                         close(sock);
@@ -1104,30 +6570,32 @@ int main(int argc, char* argv[]) {
                     }
 
                     BitTorrent::Client::SendExtensionHandshake(sock);
-                    int peer_ext_id = BitTorrent::Client::ReceiveExtensionHandshake(sock);
+                    int peer_ext_id = BitTorrent::OrThrow(BitTorrent::Client::ReceiveExtensionHandshake(peer));
                 
                     BitTorrent::Client::SendMetadataRequest(sock, peer_ext_id, 0);
                     
-                    std::vector<uint8_t> metadata_raw = BitTorrent::Client::ReceiveMetadataResponse(sock, 1);
+                    auto metadata_raw = std::make_shared<std::vector<uint8_t>>(BitTorrent::OrThrow(BitTorrent::Client::ReceiveMetadataResponse(peer, 1)));
                     
-                    std::string metadata_str(metadata_raw.begin(), metadata_raw.end());
-                    json info = BitTorrent::BEncoder::Decode(metadata_str);
+                    std::string_view metadata_str(reinterpret_cast<const char*>(metadata_raw->data()), metadata_raw->size());
+                    BitTorrent::InfoDict info = BitTorrent::OrThrow(BitTorrent::BBinder::Decode<BitTorrent::InfoDict>(metadata_str));
                     
-                    t.length = info["length"].get<long long>();
-                    t.piece_length = info["piece length"].get<long long>();
-                    t.pieces = info["pieces"].get<std::string>();
-                    if (info.contains("name")) {
-                        t.name = info["name"].get<std::string>();
+                    t.storage = metadata_raw;
+                    t.length = info.length;
+                    t.piece_length = info.piece_length;
+                    t.pieces = info.pieces;
+                    if (info.name) {
+                        t.name = *info.name;
                     }
                     t.info_hash_str = info_hash_hex;
+                    peer.Throttle(BitTorrent::Bandwidth::Torrent(t.info_hash_str), BitTorrent::Bandwidth::Peer(BitTorrent::Network::Name(address)));
 
-                    BitTorrent::Client::WaitForUnchoke(sock);
+                    BitTorrent::OrThrow(BitTorrent::Client::WaitForUnchoke(peer));
                     
                     std::ofstream out(output, std::ios::binary);
                     int total_pieces = (t.length + t.piece_length - 1) / t.piece_length;
 
                     for (int i = 0; i < total_pieces; i++) {
-                        auto data = BitTorrent::Client::DownloadPiece(sock, t, i);
+                        auto data = BitTorrent::OrThrow(BitTorrent::Client::DownloadPiece(peer, t, i));
                         out.write((char*)data.data(), data.size());
                         std::cout << "Downloaded piece " << i << "\n";
                     }
@@ -1137,13 +6605,81 @@ int main(int argc, char* argv[]) {
                     return 0;
                     
                 } catch (const std::exception& e) {
-                    if (sock >= 0) close(sock);
+                    close(sock);
                     continue;
                 }
             }
             std::cerr << "Failed to download file from any peer\n";
             return 1;
         }
+        else if (cmd == "scan") {
+            if (argc < 3) return 1;
+            int failures = 0;
+            for (int i = 2; i < argc; i++) {
+                try {
+                    BitTorrent::MappedFile file(argv[i]);
+                    auto index = BitTorrent::OrThrow(BitTorrent::BLazyIndex::Build(file.View()));
+                    auto info = index.Root().At("info");
+                    auto hash = BitTorrent::Utils::CalculateSHA1(info.Raw());
+                    auto name = info.Find("name");
+                    std::cout << BitTorrent::Utils::ToHex(hash.data(), 20) << " " << (name ? name.AsString() : "") << "\n";
+                } catch (const std::exception& e) {
+                    std::cerr << argv[i] << ": " << e.what() << "\n";
+                    failures++;
+                }
+            }
+            return failures == 0 ? 0 : 1;
+        }
+        else if (cmd == "compile") {
+            if (argc < 4) return 1;
+            auto t = BitTorrent::Client::LoadTorrent(argv[2]);
+            BitTorrent::CompiledTorrent::Write(t, argv[3]);
+            std::cout << "Compiled " << t.pieces.size() / 20 << " piece hashes into " << argv[3] << "\n";
+        }
+        else if (cmd == "index") {
+            if (argc < 4) return 1;
+            std::vector<std::string> paths;
+            for (const auto& entry : std::filesystem::recursive_directory_iterator(argv[2])) {
+                if (entry.is_regular_file() && entry.path().extension() == ".torrent") paths.push_back(entry.path().string());
+            }
+            std::sort(paths.begin(), paths.end());
+
+            unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+            std::vector<std::pair<std::string, std::string>> failures;
+            auto torrents = BitTorrent::Catalog::LoadAll(paths, threads, failures);
+            for (const auto& [path, error] : failures) std::cerr << path << ": " << error << "\n";
+            size_t written = BitTorrent::Catalog::Write(argv[3], std::move(torrents));
+            std::cout << "Indexed " << written << " torrents into " << argv[3] << "\n";
+            return failures.empty() ? 0 : 1;
+        }
+        else if (cmd == "catalog") {
+            if (argc < 3) return 1;
+            BitTorrent::Catalog catalog(argv[2]);
+            if (argc < 4) {
+                for (size_t i = 0; i < catalog.Size(); i++) {
+                    const auto& e = catalog.Entry(i);
+                    std::cout << BitTorrent::Utils::ToHex(e.info_hash, 20) << " " << catalog.Name(e) << "\n";
+                }
+                return 0;
+            }
+            const auto* e = catalog.Find(BitTorrent::Utils::HexToBytes(argv[3]));
+            if (!e) {
+                std::cerr << "Not in catalog: " << argv[3] << "\n";
+                return 1;
+            }
+            std::cout << "Name: " << catalog.Name(*e) << "\n";
+            std::cout << "Length: " << e->length << "\n";
+            std::cout << "Info Hash: " << BitTorrent::Utils::ToHex(e->info_hash, 20) << "\n";
+            std::cout << "Piece Length: " << e->piece_length << "\n";
+            std::cout << "Piece Hashes:\n";
+            std::string_view pieces = catalog.Pieces(*e);
+            for (size_t i = 0; i < pieces.size(); i += 20) {
+                std::cout << BitTorrent::Utils::ToHex((const unsigned char*)pieces.data() + i, 20) << "\n";
+            }
+        }
+        else if (cmd == "bench") {
+            return BitTorrent::Bench::Run(argc, argv);
+        }
         else {
             std::cerr << "Unknown command: " << cmd << "\n";
             return 1;